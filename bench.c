@@ -0,0 +1,626 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#include <sched.h>
+#endif
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#ifdef UTF8_BENCH_PERF
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include "utf8_valid.h"
+
+/*
+ *  Throughput benchmark
+ *
+ *  Times utf8_valid and utf8_check with every kernel supported by the CPU,
+ *  and utf8_maximal_subpart, over generated corpora. Every measurement is
+ *  the median of a number of runs after warm-up runs, on a thread pinned
+ *  to one CPU.
+ *
+ *  Error scanning is timed over corpora with an error every so many bytes,
+ *  with utf8_find_errors and with utf8_check restarted after every error,
+ *  and with utf8_sanitize and utf8_sanitize_inplace, and reported over the
+ *  whole input. Each in-place run copies the corpus first, and the copy is
+ *  part of the time.
+ *
+ *  Latency is measured over pools of short strings with lengths drawn from
+ *  a bucket, calling each kernel directly, through utf8_check and through
+ *  utf8_valid_batch.
+ *
+ *  Built with UTF8_BENCH_PERF, a final section reads the cycles,
+ *  instructions, branch-misses and L1D read misses hardware counters with
+ *  perf_event_open around the runs of each utf8_check kernel. Counters the
+ *  host does not provide are reported as "-".
+ *
+ *  usage: bench [size in KiB]
+ */
+
+#define BENCH_WARMUP 3
+#define BENCH_RUNS   15
+#define BENCH_POOL   4096
+
+typedef struct {
+  const char *name;
+  unsigned weight[4];     /* weights of sequence lengths 1-4 */
+  uint32_t lo[4], hi[4];  /* code point range of each length */
+  int error;              /* -1 none, else position of an error in percent */
+} corpus_t;
+
+static const corpus_t Corpora[] = {
+  { "ascii",        { 1, 0, 0, 0 },    { 0x20, 0, 0, 0 },
+                                       { 0x7E, 0, 0, 0 }, -1 },
+  { "latin1",       { 85, 15, 0, 0 },  { 0x20, 0xA0, 0, 0 },
+                                       { 0x7E, 0xFF, 0, 0 }, -1 },
+  { "cyrillic",     { 20, 80, 0, 0 },  { 0x20, 0x0400, 0, 0 },
+                                       { 0x40, 0x04FF, 0, 0 }, -1 },
+  { "cjk",          { 15, 0, 85, 0 },  { 0x20, 0, 0x4E00, 0 },
+                                       { 0x40, 0, 0x9FFF, 0 }, -1 },
+  { "emoji",        { 40, 0, 0, 60 },  { 0x20, 0, 0, 0x1F300 },
+                                       { 0x7E, 0, 0, 0x1FAFF }, -1 },
+  { "mixed",        { 1, 1, 1, 1 },    { 0x00, 0x80, 0xE000, 0x10000 },
+                                       { 0x7F, 0x7FF, 0xFFFF, 0x10FFFF }, -1 },
+  { "error-start",  { 1, 1, 1, 1 },    { 0x00, 0x80, 0xE000, 0x10000 },
+                                       { 0x7F, 0x7FF, 0xFFFF, 0x10FFFF }, 0 },
+  { "error-middle", { 1, 1, 1, 1 },    { 0x00, 0x80, 0xE000, 0x10000 },
+                                       { 0x7F, 0x7FF, 0xFFFF, 0x10FFFF }, 50 },
+  { "error-end",    { 1, 1, 1, 1 },    { 0x00, 0x80, 0xE000, 0x10000 },
+                                       { 0x7F, 0x7FF, 0xFFFF, 0x10FFFF }, 100 },
+};
+
+typedef struct {
+  const char *name;
+  int corpus;             /* index in Corpora */
+  size_t every;           /* bytes per error */
+} dirty_t;
+
+static const dirty_t Dirty[] = {
+  { "cjk-dirty64",   3, 64 },
+  { "cjk-dirty4k",   3, 4096 },
+  { "mixed-dirty64", 5, 64 },
+};
+
+static uint64_t RandomState = 0x9E3779B97F4A7C15;
+
+static uint32_t
+random_u32(void) {
+  RandomState ^= RandomState << 13;
+  RandomState ^= RandomState >> 7;
+  RandomState ^= RandomState << 17;
+  return (uint32_t)(RandomState >> 32);
+}
+
+static size_t
+encode(uint32_t ord, char *dst) {
+  unsigned char *d = (unsigned char *)dst;
+
+  if (ord < 0x80) {
+    d[0] = ord;
+    return 1;
+  }
+  if (ord < 0x800) {
+    d[0] = 0xC0 | ord >> 6;
+    d[1] = 0x80 | (ord & 0x3F);
+    return 2;
+  }
+  if (ord < 0x10000) {
+    d[0] = 0xE0 | ord >> 12;
+    d[1] = 0x80 | (ord >> 6 & 0x3F);
+    d[2] = 0x80 | (ord & 0x3F);
+    return 3;
+  }
+  d[0] = 0xF0 | ord >> 18;
+  d[1] = 0x80 | (ord >> 12 & 0x3F);
+  d[2] = 0x80 | (ord >> 6 & 0x3F);
+  d[3] = 0x80 | (ord & 0x3F);
+  return 4;
+}
+
+/*
+ *  Fills dst with len bytes of the corpus, padding the end with ASCII
+ *  when the next sequence does not fit.
+ */
+static void
+generate(const corpus_t *c, char *dst, size_t len) {
+  unsigned total, r, n;
+  uint32_t ord;
+  size_t i;
+
+  total = c->weight[0] + c->weight[1] + c->weight[2] + c->weight[3];
+  for (i = 0; i < len; ) {
+    r = random_u32() % total;
+    for (n = 0; r >= c->weight[n]; n++)
+      r -= c->weight[n];
+    do {
+      ord = c->lo[n] + random_u32() % (c->hi[n] - c->lo[n] + 1);
+    } while (ord >= 0xD800 && ord <= 0xDFFF);
+    if (len - i < n + 1)
+      ord = ' ';
+    i += encode(ord, dst + i);
+  }
+
+  if (c->error >= 0)
+    dst[(len - 1) * c->error / 100] = (char)0xFF;
+}
+
+static double
+now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t
+ticks(void) {
+#ifdef UTF8_VALID_X86
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+static int
+compare_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+typedef enum {
+  BENCH_VALID,
+  BENCH_CHECK,
+  BENCH_SUBPART,
+  BENCH_FIND_ERRORS,
+  BENCH_RESTART,
+  BENCH_SANITIZE,
+  BENCH_SANITIZE_INPLACE
+} function_t;
+
+static volatile size_t Sink;
+static char *Out;       /* sanitized output, three bytes per input byte */
+
+static void
+run(function_t f, const char *src, size_t len) {
+  size_t off, cur;
+
+  switch (f) {
+    case BENCH_VALID:
+      Sink += utf8_valid(src, len);
+      break;
+    case BENCH_CHECK:
+      utf8_check(src, len, &cur);
+      Sink += cur;
+      break;
+    case BENCH_SUBPART:
+      for (off = 0; off < len; off += utf8_maximal_subpart(src + off, len - off))
+        ;
+      Sink += off;
+      break;
+    case BENCH_FIND_ERRORS:
+      Sink += utf8_find_errors(src, len, NULL, 0);
+      break;
+    case BENCH_RESTART:
+      for (off = 0; !utf8_check(src + off, len - off, &cur); )
+        off += cur + utf8_maximal_subpart(src + off + cur, len - off - cur);
+      Sink += off;
+      break;
+    case BENCH_SANITIZE:
+      Sink += utf8_sanitize(src, len, Out, 3 * len);
+      break;
+    case BENCH_SANITIZE_INPLACE:
+      memcpy(Out, src, len);
+      Sink += utf8_sanitize_inplace(Out, len, '?');
+      break;
+  }
+}
+
+/*
+ *  Returns the median time of one run in seconds, and the median number of
+ *  time stamp counter ticks in *tsc.
+ */
+static double
+measure(function_t f, const char *src, size_t len, double *tsc) {
+  double times[BENCH_RUNS], counts[BENCH_RUNS], t;
+  uint64_t c;
+  int i;
+
+  for (i = 0; i < BENCH_WARMUP; i++)
+    run(f, src, len);
+
+  for (i = 0; i < BENCH_RUNS; i++) {
+    t = now();
+    c = ticks();
+    run(f, src, len);
+    counts[i] = (double)(ticks() - c);
+    times[i] = now() - t;
+  }
+
+  qsort(times, BENCH_RUNS, sizeof(double), compare_double);
+  qsort(counts, BENCH_RUNS, sizeof(double), compare_double);
+  *tsc = counts[BENCH_RUNS / 2];
+  return times[BENCH_RUNS / 2];
+}
+
+/*
+ *  Throughput is reported over the valid prefix of the corpus, the bytes
+ *  actually examined before a function stops at the first error.
+ */
+static void
+report(const char *corpus, const char *function, const char *kernel,
+       size_t len, double t, double tsc) {
+  if (len)
+    printf("%-13s %-22s %-8s %9.2f %9.3f %11.1f\n", corpus, function, kernel,
+      len / t * 1e-9, tsc / len, t * 1e6);
+  else
+    printf("%-13s %-22s %-8s %9s %9s %11.1f\n", corpus, function, kernel,
+      "-", "-", t * 1e6);
+}
+
+typedef struct {
+  size_t lo, hi;
+} bucket_t;
+
+static const bucket_t Buckets[] = {
+  { 1, 4 }, { 5, 8 }, { 9, 16 }, { 17, 32 }, { 33, 64 }, { 65, 128 },
+};
+
+/*
+ *  Returns the median time of one call in seconds over a pool of strings,
+ *  and the median number of time stamp counter ticks per call in *tsc.
+ */
+static double
+measure_latency(bool (*check)(const char *, size_t, size_t *),
+                const char *const *ptrs, const size_t *lens, double *tsc) {
+  double times[BENCH_RUNS], counts[BENCH_RUNS], t;
+  size_t i, cur, sum = 0;
+  uint64_t c;
+  int r;
+
+  for (r = -BENCH_WARMUP; r < BENCH_RUNS; r++) {
+    t = now();
+    c = ticks();
+    for (i = 0; i < BENCH_POOL; i++) {
+      check(ptrs[i], lens[i], &cur);
+      sum += cur;
+    }
+    if (r >= 0) {
+      counts[r] = (double)(ticks() - c) / BENCH_POOL;
+      times[r] = (now() - t) / BENCH_POOL;
+    }
+  }
+  Sink += sum;
+
+  qsort(times, BENCH_RUNS, sizeof(double), compare_double);
+  qsort(counts, BENCH_RUNS, sizeof(double), compare_double);
+  *tsc = counts[BENCH_RUNS / 2];
+  return times[BENCH_RUNS / 2];
+}
+
+/*
+ *  Returns the median time per string of utf8_valid_batch over the pool.
+ */
+static double
+measure_batch(const char *const *ptrs, const size_t *lens, double *tsc) {
+  static uint8_t results[BENCH_POOL];
+  double times[BENCH_RUNS], counts[BENCH_RUNS], t;
+  uint64_t c;
+  int r;
+
+  for (r = -BENCH_WARMUP; r < BENCH_RUNS; r++) {
+    t = now();
+    c = ticks();
+    Sink += utf8_valid_batch(ptrs, lens, BENCH_POOL, results);
+    if (r >= 0) {
+      counts[r] = (double)(ticks() - c) / BENCH_POOL;
+      times[r] = (now() - t) / BENCH_POOL;
+    }
+  }
+
+  qsort(times, BENCH_RUNS, sizeof(double), compare_double);
+  qsort(counts, BENCH_RUNS, sizeof(double), compare_double);
+  *tsc = counts[BENCH_RUNS / 2];
+  return times[BENCH_RUNS / 2];
+}
+
+static void
+latency(void) {
+  static const int corpora[] = { 0, 5 };  /* ascii, mixed */
+  const char *ptrs[BENCH_POOL];
+  size_t lens[BENCH_POOL], i, j, k, off;
+  char *pool;
+  double t, tsc;
+  int kernel;
+
+  pool = malloc(BENCH_POOL * 128);
+  if (!pool)
+    return;
+
+  printf("\n%-13s %-9s %-22s %-7s %9s %9s\n",
+    "corpus", "length", "function", "kernel", "ns/call", "cycles");
+
+  for (i = 0; i < sizeof(corpora) / sizeof(corpora[0]); i++) {
+    for (j = 0; j < sizeof(Buckets) / sizeof(Buckets[0]); j++) {
+      char length[16];
+
+      snprintf(length, sizeof(length), "%u-%u",
+        (unsigned)Buckets[j].lo, (unsigned)Buckets[j].hi);
+
+      for (k = 0, off = 0; k < BENCH_POOL; k++) {
+        lens[k] = Buckets[j].lo + random_u32() % (Buckets[j].hi - Buckets[j].lo + 1);
+        ptrs[k] = pool + off;
+        generate(&Corpora[corpora[i]], pool + off, lens[k]);
+        off += lens[k];
+      }
+
+      for (kernel = UTF8_KERNEL_SCALAR; kernel < UTF8_KERNEL_COUNT; kernel++) {
+        if (!utf8_kernel_select((utf8_kernel_t)kernel))
+          continue;
+
+        t = measure_latency(utf8_kernel_function((utf8_kernel_t)kernel), ptrs, lens, &tsc);
+        printf("%-13s %-9s %-22s %-7s %9.2f %9.1f\n", Corpora[corpora[i]].name,
+          length, "kernel", utf8_kernel_name((utf8_kernel_t)kernel), t * 1e9, tsc);
+
+        t = measure_latency(utf8_check, ptrs, lens, &tsc);
+        printf("%-13s %-9s %-22s %-7s %9.2f %9.1f\n", Corpora[corpora[i]].name,
+          length, "utf8_check", utf8_kernel_name((utf8_kernel_t)kernel), t * 1e9, tsc);
+
+        t = measure_batch(ptrs, lens, &tsc);
+        printf("%-13s %-9s %-22s %-7s %9.2f %9.1f\n", Corpora[corpora[i]].name,
+          length, "utf8_valid_batch", utf8_kernel_name((utf8_kernel_t)kernel), t * 1e9, tsc);
+      }
+      utf8_kernel_select(UTF8_KERNEL_AUTO);
+    }
+  }
+
+  free(pool);
+}
+
+#ifdef UTF8_BENCH_PERF
+enum {
+  COUNTER_CYCLES,
+  COUNTER_INSTRUCTIONS,
+  COUNTER_BRANCH_MISSES,
+  COUNTER_L1D_MISSES,
+  COUNTER_COUNT
+};
+
+static int Counters[COUNTER_COUNT];
+
+/*
+ *  Opens the counters for the calling thread, user space only. Returns
+ *  false if none of them is available.
+ */
+static bool
+counters_open(void) {
+  static const struct {
+    uint32_t type;
+    uint64_t config;
+  } events[COUNTER_COUNT] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D
+                        | PERF_COUNT_HW_CACHE_OP_READ << 8
+                        | PERF_COUNT_HW_CACHE_RESULT_MISS << 16 },
+  };
+  struct perf_event_attr attr;
+  bool any = false;
+  int i;
+
+  for (i = 0; i < COUNTER_COUNT; i++) {
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = events[i].type;
+    attr.config = events[i].config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    Counters[i] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    if (Counters[i] >= 0)
+      any = true;
+  }
+  return any;
+}
+
+static void
+counters_close(void) {
+  int i;
+
+  for (i = 0; i < COUNTER_COUNT; i++) {
+    if (Counters[i] >= 0)
+      close(Counters[i]);
+  }
+}
+
+static void
+counters_start(void) {
+  int i;
+
+  for (i = 0; i < COUNTER_COUNT; i++) {
+    if (Counters[i] >= 0) {
+      ioctl(Counters[i], PERF_EVENT_IOC_RESET, 0);
+      ioctl(Counters[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+}
+
+/*
+ *  Stops the counters and stores their values, -1 for a counter that is
+ *  not available.
+ */
+static void
+counters_stop(double values[COUNTER_COUNT]) {
+  uint64_t v;
+  int i;
+
+  for (i = 0; i < COUNTER_COUNT; i++) {
+    if (Counters[i] >= 0)
+      ioctl(Counters[i], PERF_EVENT_IOC_DISABLE, 0);
+  }
+  for (i = 0; i < COUNTER_COUNT; i++) {
+    values[i] = -1;
+    if (Counters[i] >= 0 && read(Counters[i], &v, sizeof(v)) == sizeof(v))
+      values[i] = (double)v;
+  }
+}
+
+static void
+print_counter(double value, double scale) {
+  if (value < 0)
+    printf(" %9s", "-");
+  else
+    printf(" %9.3f", value * scale);
+}
+
+/*
+ *  Reports cycles and instructions per byte, instructions per cycle, and
+ *  branch-misses and L1D read misses per KiB for utf8_check with every
+ *  kernel over every corpus.
+ */
+static void
+counters(char *src, size_t len) {
+  double values[COUNTER_COUNT];
+  size_t i, cur, bytes;
+  int kernel, r;
+
+  printf("\n%-13s %-7s %9s %9s %9s %9s %9s\n", "corpus", "kernel",
+    "cycles/B", "instr/B", "IPC", "brmiss/K", "l1dmiss/K");
+
+  if (!counters_open()) {
+    printf("no hardware counters available\n");
+    return;
+  }
+
+  for (i = 0; i < sizeof(Corpora) / sizeof(Corpora[0]); i++) {
+    generate(&Corpora[i], src, len);
+    utf8_check_scalar(src, len, &cur);
+    if (cur == 0)
+      continue;
+
+    for (kernel = UTF8_KERNEL_SCALAR; kernel < UTF8_KERNEL_COUNT; kernel++) {
+      if (!utf8_kernel_select((utf8_kernel_t)kernel))
+        continue;
+
+      for (r = 0; r < BENCH_WARMUP; r++)
+        run(BENCH_CHECK, src, len);
+
+      counters_start();
+      for (r = 0; r < BENCH_RUNS; r++)
+        run(BENCH_CHECK, src, len);
+      counters_stop(values);
+
+      bytes = cur * BENCH_RUNS;
+      printf("%-13s %-7s", Corpora[i].name, utf8_kernel_name((utf8_kernel_t)kernel));
+      print_counter(values[COUNTER_CYCLES], 1.0 / bytes);
+      print_counter(values[COUNTER_INSTRUCTIONS], 1.0 / bytes);
+      if (values[COUNTER_CYCLES] > 0 && values[COUNTER_INSTRUCTIONS] >= 0)
+        print_counter(values[COUNTER_INSTRUCTIONS] / values[COUNTER_CYCLES], 1);
+      else
+        print_counter(-1, 1);
+      print_counter(values[COUNTER_BRANCH_MISSES], 1024.0 / bytes);
+      print_counter(values[COUNTER_L1D_MISSES], 1024.0 / bytes);
+      printf("\n");
+    }
+    utf8_kernel_select(UTF8_KERNEL_AUTO);
+  }
+
+  counters_close();
+}
+#endif
+
+static void
+pin(void) {
+#ifdef __linux__
+  cpu_set_t set;
+  int cpu = sched_getcpu();
+
+  if (cpu >= 0) {
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) == 0)
+      printf("pinned to cpu %d\n", cpu);
+  }
+#endif
+}
+
+int
+main(int argc, char **argv) {
+  size_t len, cur, off, i;
+  char *src;
+  double t, tsc;
+  int kernel;
+
+  len = (argc > 1 ? (size_t)strtoul(argv[1], NULL, 10) : 1024) * 1024;
+  if (len == 0)
+    len = 1024 * 1024;
+
+  src = malloc(len);
+  Out = malloc(3 * len);
+  if (!src || !Out)
+    return 1;
+
+  pin();
+  printf("%u KiB per corpus, median of %d runs after %d warm-up runs\n",
+    (unsigned)(len / 1024), BENCH_RUNS, BENCH_WARMUP);
+  printf("cycles are time stamp counter ticks\n\n");
+  printf("%-13s %-22s %-8s %9s %9s %11s\n",
+    "corpus", "function", "kernel", "GB/s", "cycles/B", "median us");
+
+  for (i = 0; i < sizeof(Corpora) / sizeof(Corpora[0]); i++) {
+    generate(&Corpora[i], src, len);
+    utf8_check_scalar(src, len, &cur);
+
+    for (kernel = UTF8_KERNEL_SCALAR; kernel < UTF8_KERNEL_COUNT; kernel++) {
+      if (!utf8_kernel_select((utf8_kernel_t)kernel))
+        continue;
+
+      t = measure(BENCH_VALID, src, len, &tsc);
+      report(Corpora[i].name, "utf8_valid", utf8_kernel_name((utf8_kernel_t)kernel), cur, t, tsc);
+
+      t = measure(BENCH_CHECK, src, len, &tsc);
+      report(Corpora[i].name, "utf8_check", utf8_kernel_name((utf8_kernel_t)kernel), cur, t, tsc);
+    }
+    utf8_kernel_select(UTF8_KERNEL_AUTO);
+
+    t = measure(BENCH_SUBPART, src, cur, &tsc);
+    report(Corpora[i].name, "utf8_maximal_subpart", "-", cur, t, tsc);
+  }
+
+  for (i = 0; i < sizeof(Dirty) / sizeof(Dirty[0]); i++) {
+    generate(&Corpora[Dirty[i].corpus], src, len);
+    for (off = Dirty[i].every - 1; off < len; off += Dirty[i].every)
+      src[off] = (char)0xFF;
+
+    for (kernel = UTF8_KERNEL_SCALAR; kernel < UTF8_KERNEL_COUNT; kernel++) {
+      if (!utf8_kernel_select((utf8_kernel_t)kernel))
+        continue;
+
+      t = measure(BENCH_FIND_ERRORS, src, len, &tsc);
+      report(Dirty[i].name, "utf8_find_errors", utf8_kernel_name((utf8_kernel_t)kernel), len, t, tsc);
+
+      t = measure(BENCH_RESTART, src, len, &tsc);
+      report(Dirty[i].name, "utf8_check restarted", utf8_kernel_name((utf8_kernel_t)kernel), len, t, tsc);
+
+      t = measure(BENCH_SANITIZE, src, len, &tsc);
+      report(Dirty[i].name, "utf8_sanitize", utf8_kernel_name((utf8_kernel_t)kernel), len, t, tsc);
+
+      t = measure(BENCH_SANITIZE_INPLACE, src, len, &tsc);
+      report(Dirty[i].name, "utf8_sanitize_inplace", utf8_kernel_name((utf8_kernel_t)kernel), len, t, tsc);
+    }
+    utf8_kernel_select(UTF8_KERNEL_AUTO);
+  }
+
+  latency();
+#ifdef UTF8_BENCH_PERF
+  counters(src, len);
+#endif
+
+  free(Out);
+  free(src);
+  return 0;
+}
@@ -3,8 +3,16 @@
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
+/* Small blocks, so that short inputs span several blocks */
+#define UTF8_VALID_BLOCK 64
+/* Split short inputs into segments for the shift DFA */
+#define UTF8_SHIFT_DFA_SPLIT 8
 #include "utf8_valid.h"
 
+/* Small chunks, so that short inputs are split across many threads */
+#define UTF8_PARALLEL_MIN_CHUNK 8
+#include "utf8_parallel.h"
+
 /*
  *  UTF-8
  *
@@ -76,6 +84,27 @@ encode_ord(uint32_t ord, size_t len, char *dst) {
   return dst;
 }
 
+/*
+ *  Decodes well-formed UTF-8 to ordinals, returns the number of ordinals.
+ */
+size_t
+decode_ords(const char *src, size_t len, uint32_t *dst) {
+  const unsigned char *s = (const unsigned char *)src;
+  size_t i, j, n, count;
+  uint32_t ord;
+
+  for (i = 0, count = 0; i < len; i += n) {
+    ord = s[i];
+    n = ord < 0x80 ? 1 : ord < 0xE0 ? 2 : ord < 0xF0 ? 3 : 4;
+    if (n > 1)
+      ord &= 0x7F >> n;
+    for (j = 1; j < n; j++)
+      ord = ord << 6 | (s[i + j] & 0x3F);
+    dst[count++] = ord;
+  }
+  return count;
+}
+
 char *
 escape_str(const char *src, size_t len, char *dst) {
   static const char * const kHex = "0123456789ABCDEF";
@@ -104,13 +133,16 @@ static size_t TestCount  = 0;
 static size_t TestFailed = 0;
 
 void
-test_utf8(const char *src, size_t len, size_t exp_spl, bool exp_ret, unsigned line) {
+test_utf8(const char *src, size_t len, size_t exp_spl, utf8_status_t exp_status, unsigned line) {
+  static const char * const kStatus[] = { "UTF8_OK", "UTF8_INCOMPLETE", "UTF8_INVALID" };
   char escaped[255 * 4 + 1];
-  size_t offset, got_spl;
-  bool got_ret;
+  size_t offset, got_offset, got_spl;
+  utf8_status_t got_status;
+  bool exp_ret, got_ret;
 
   assert(len <= 255);
 
+  exp_ret = exp_status == UTF8_OK;
   got_ret = utf8_check(src, len, &offset);
 
   TestCount++;
@@ -124,6 +156,19 @@ test_utf8(const char *src, size_t len, size_t exp_spl, bool exp_ret, unsigned li
     TestFailed++;
   }
 
+  TestCount++;
+
+  got_status = utf8_check_status(src, len, &got_offset);
+
+  if (got_status != exp_status || got_offset != offset) {
+    escape_str(src, len, escaped);
+
+    printf("utf8_check_status(\"%s\", %d) != %s (got: %s) at line %u\n",
+      escaped, (unsigned)len, kStatus[exp_status], kStatus[got_status], line);
+
+    TestFailed++;
+  }
+
   src += offset;
   len -= offset;
 
@@ -142,8 +187,764 @@ test_utf8(const char *src, size_t len, size_t exp_spl, bool exp_ret, unsigned li
 }
 
 #define TEST_UTF8(src, len, subpart, exp) \
-  test_utf8(src, len, subpart, exp, __LINE__)
+  test_utf8(src, len, subpart, (exp) ? UTF8_OK : UTF8_INVALID, __LINE__)
+
+#define TEST_UTF8_INCOMPLETE(src, len, subpart) \
+  test_utf8(src, len, subpart, UTF8_INCOMPLETE, __LINE__)
+
+
+/*
+ *  Bytes at the boundaries of the ranges in the table above, sequences
+ *  of these bytes cover every row and every transition between rows.
+ */
+static const unsigned char Boundaries[] = {
+  0x00, 0x41, 0x7F, 0x80, 0x8F, 0x90, 0x9F, 0xA0, 0xBF, 0xC0, 0xC1, 0xC2,
+  0xDF, 0xE0, 0xE1, 0xEC, 0xED, 0xEE, 0xEF, 0xF0, 0xF1, 0xF3, 0xF4, 0xF5,
+  0xF8, 0xFF
+};
+
+static uint64_t RandomState = 0x9E3779B97F4A7C15;
+
+uint32_t
+random_u32() {
+  RandomState ^= RandomState << 13;
+  RandomState ^= RandomState >> 7;
+  RandomState ^= RandomState << 17;
+  return (uint32_t)(RandomState >> 32);
+}
+
+/*
+ *  Fills dst with len bytes of UTF-8 mixing the sequence lengths up to
+ *  max_len, and corrupts a byte now and then.
+ */
+void
+random_utf8_max(char *dst, size_t len, size_t max_len) {
+  static const uint32_t kBase[4] = { 0x0000, 0x0080, 0x0800, 0x10000 };
+  static const uint32_t kSpan[4] = { 0x0080, 0x0780, 0xF800, 0x100000 };
+  uint32_t ord;
+  size_t i, n;
+
+  for (i = 0; i < len; i += n) {
+    n = 1 + random_u32() % max_len;
+    if (n > len - i)
+      n = len - i;
+    do {
+      ord = kBase[n - 1] + random_u32() % kSpan[n - 1];
+    } while (ord >= 0xD800 && ord <= 0xDFFF);
+    encode_ord(ord, n, dst + i);
+  }
+  if (len && random_u32() % 2)
+    dst[random_u32() % len] = Boundaries[random_u32() % sizeof(Boundaries)];
+}
+
+/*
+ *  Fills dst with len bytes of UTF-8 mixing every sequence length.
+ */
+void
+random_utf8(char *dst, size_t len) {
+  random_utf8_max(dst, len, 4);
+}
+
+/*
+ *  Fills src with random UTF-8 and overwrites windows of it with
+ *  boundary bytes, which gives runs of ill-formed sequences.
+ */
+void
+random_dirty_utf8(char *src, size_t len, size_t windows) {
+  size_t i, pos;
+
+  random_utf8(src, len);
+  while (len && windows--) {
+    pos = random_u32() % len;
+    for (i = pos; i < len && i < pos + 1 + random_u32() % 8; i++)
+      src[i] = Boundaries[random_u32() % sizeof(Boundaries)];
+  }
+}
+
+void
+test_kernel_against_scalar(const char *name,
+                           bool (*check)(const char *, size_t, size_t *),
+                           const char *src, size_t len) {
+  char escaped[255 * 4 + 1];
+  size_t exp_cur, got_cur;
+  bool exp_ret, got_ret;
+
+  assert(len <= 255);
+
+  exp_ret = utf8_check_scalar(src, len, &exp_cur);
+  got_ret = check(src, len, &got_cur);
+
+  TestCount++;
+
+  if (got_ret != exp_ret || got_cur != exp_cur) {
+    escape_str(src, len, escaped);
+
+    printf("utf8_check_%s(\"%s\", %d) != %s, %d (got: %s, %d)\n",
+      name, escaped, (unsigned)len, exp_ret ? "true" : "false", (unsigned)exp_cur,
+      got_ret ? "true" : "false", (unsigned)got_cur);
+
+    TestFailed++;
+  }
+}
+
+void
+test_kernel(const char *name, bool (*check)(const char *, size_t, size_t *)) {
+  static const size_t kOffsets[] = { 0, 1, 13, 14, 15, 29, 30, 31, 61, 62, 63, 125, 126, 127 };
+  const size_t n = sizeof(Boundaries);
+  static char large[8192];
+  char src[255];
+  size_t i, j, k, k2, len, off, tail, count, exp_cur, got_cur;
+  bool exp_ret, got_ret;
+
+  /*
+   * Every sequence of up to four boundary bytes, placed so that it spans
+   * the block boundaries of the vector kernels, optionally followed by
+   * a well-formed tail.
+   */
+  for (k = 0; k < sizeof(kOffsets) / sizeof(kOffsets[0]); k++) {
+    off = kOffsets[k];
+    memset(src, 'a', off);
+    for (len = 1, count = n; len <= 4; len++, count *= n) {
+      for (i = 0; i < count; i++) {
+        for (j = 0, k2 = i; j < len; j++, k2 /= n)
+          src[off + j] = Boundaries[k2 % n];
+        for (tail = 0; tail <= 4; tail += 2) {
+          memcpy(src + off + len, "\xC3\xA5\xC3\xA5", tail);
+          test_kernel_against_scalar(name, check, src, off + len + tail);
+        }
+      }
+    }
+  }
+
+  for (i = 0; i < 100000; i++) {
+    len = random_u32() % 256;
+    random_utf8(src, len);
+    test_kernel_against_scalar(name, check, src, len);
+  }
+
+  /*
+   * Long inputs with a run of ASCII, so that the segments of the shift DFA
+   * end at different times.
+   */
+  for (i = 0; i < 2000; i++) {
+    len = random_u32() % sizeof(large);
+    random_utf8(large, len);
+    off = len ? random_u32() % len : 0;
+    memset(large + off, 'a', random_u32() % (len - off + 1));
+
+    exp_ret = utf8_check_scalar(large, len, &exp_cur);
+    got_ret = check(large, len, &got_cur);
+
+    TestCount++;
+    if (got_ret != exp_ret || got_cur != exp_cur) {
+      printf("utf8_check_%s(<%d bytes>) != %s, %d (got: %s, %d)\n",
+        name, (unsigned)len, exp_ret ? "true" : "false", (unsigned)exp_cur,
+        got_ret ? "true" : "false", (unsigned)got_cur);
+      TestFailed++;
+    }
+  }
+}
+
+void
+test_ascii_runs() {
+  static const char kStray[] = { (char)0x80, (char)0xE4 };
+  char buf[8 + 256], *src;
+  size_t align, len, pos, k, got_cur;
+  bool got_ret;
+
+  /*
+   * A single stray continuation or truncated lead byte at every position
+   * of ASCII runs of every alignment, the word-at-a-time and 64-byte paths
+   * must stop exactly at it.
+   */
+  for (align = 0; align < 8; align++) {
+    src = buf + align;
+    for (len = 0; len <= 256; len++) {
+      memset(src, 'a', len);
+      for (pos = 0; pos <= len; pos++) {
+        for (k = 0; k < sizeof(kStray); k++) {
+          if (pos < len)
+            src[pos] = kStray[k];
 
+          got_ret = utf8_check(src, len, &got_cur);
+
+          TestCount++;
+          if (got_ret != (pos == len) || got_cur != pos) {
+            printf("utf8_check(<%u ASCII bytes aligned at %u>, %u) != %u (got: %u)\n",
+              (unsigned)len, (unsigned)align, (unsigned)len, (unsigned)pos, (unsigned)got_cur);
+            TestFailed++;
+          }
+
+          if (pos < len)
+            src[pos] = 'a';
+        }
+      }
+    }
+  }
+}
+
+void
+test_stream() {
+  char src[255], escaped[255 * 4 + 1];
+  utf8_stream_t stream;
+  size_t i, len, off, n, exp_cur;
+  bool exp_ret, got_ret;
+
+  /*
+   * Random input fed in random chunks, including empty chunks and chunks
+   * of a single byte, must give the same result and cursor as the whole
+   * input at once.
+   */
+  for (i = 0; i < 20000; i++) {
+    len = random_u32() % 256;
+    random_utf8(src, len);
+    exp_ret = utf8_check(src, len, &exp_cur);
+
+    utf8_stream_init(&stream);
+    got_ret = true;
+    for (off = 0; off < len && got_ret; off += n) {
+      n = random_u32() % (i % 2 ? 5 : 40);
+      if (n > len - off)
+        n = len - off;
+      got_ret = utf8_stream_update(&stream, src + off, n);
+    }
+    got_ret = utf8_stream_finish(&stream) && got_ret;
+
+    TestCount++;
+    if (got_ret != exp_ret || stream.cursor != exp_cur) {
+      escape_str(src, len, escaped);
+      printf("utf8_stream(\"%s\", %d) != %s, %d (got: %s, %d)\n",
+        escaped, (unsigned)len, exp_ret ? "true" : "false", (unsigned)exp_cur,
+        got_ret ? "true" : "false", (unsigned)stream.cursor);
+      TestFailed++;
+    }
+  }
+}
+
+void
+test_parallel() {
+  char src[255], escaped[255 * 4 + 1];
+  size_t i, len, exp_cur, got_cur;
+  unsigned nthreads;
+  bool exp_ret, got_ret;
+
+  /*
+   * Random input with a window of boundary bytes, which puts runs of
+   * continuation bytes and truncated sequences at the chunk boundaries.
+   */
+  for (i = 0; i < 2000; i++) {
+    len = random_u32() % 256;
+    if (i % 2)
+      random_dirty_utf8(src, len, 1);
+    else
+      random_utf8(src, len);
+    nthreads = 1 + i % 4;
+
+    exp_ret = utf8_check(src, len, &exp_cur);
+    got_ret = utf8_check_parallel(src, len, nthreads, &got_cur);
+
+    TestCount++;
+    if (got_ret != exp_ret || got_cur != exp_cur) {
+      escape_str(src, len, escaped);
+      printf("utf8_check_parallel(\"%s\", %d, %u) != %s, %d (got: %s, %d)\n",
+        escaped, (unsigned)len, nthreads, exp_ret ? "true" : "false", (unsigned)exp_cur,
+        got_ret ? "true" : "false", (unsigned)got_cur);
+      TestFailed++;
+    }
+  }
+}
+
+void
+test_batch() {
+  char pool[64][64];
+  const char *ptrs[64];
+  size_t lens[64], i, n, exp_valid, got_valid;
+  uint8_t results[64];
+  int kernel, round;
+
+  for (kernel = UTF8_KERNEL_SCALAR; kernel < UTF8_KERNEL_COUNT; kernel++) {
+    if (!utf8_kernel_select((utf8_kernel_t)kernel))
+      continue;
+
+    for (round = 0; round < 1000; round++) {
+      n = random_u32() % 65;
+      exp_valid = 0;
+      for (i = 0; i < n; i++) {
+        lens[i] = random_u32() % 65;
+        if (random_u32() % 4 == 0)
+          random_dirty_utf8(pool[i], lens[i], 1);
+        else
+          random_utf8(pool[i], lens[i]);
+        ptrs[i] = pool[i];
+        exp_valid += utf8_check_scalar(pool[i], lens[i], NULL);
+      }
+
+      memset(results, 0xAA, sizeof(results));
+      got_valid = utf8_valid_batch(ptrs, lens, n, results);
+
+      TestCount++;
+      if (got_valid != exp_valid) {
+        printf("utf8_valid_batch(<%u strings>) != %u (got: %u)\n",
+          (unsigned)n, (unsigned)exp_valid, (unsigned)got_valid);
+        TestFailed++;
+      }
+
+      for (i = 0; i < n; i++) {
+        TestCount++;
+        if (results[i] != utf8_check_scalar(pool[i], lens[i], NULL)) {
+          printf("utf8_valid_batch(<%u strings>): results[%u] == %u\n",
+            (unsigned)n, (unsigned)i, results[i]);
+          TestFailed++;
+        }
+      }
+
+      TestCount++;
+      if (utf8_valid_batch(ptrs, lens, n, NULL) != exp_valid) {
+        printf("utf8_valid_batch(<%u strings>, NULL) != %u\n",
+          (unsigned)n, (unsigned)exp_valid);
+        TestFailed++;
+      }
+    }
+  }
+  utf8_kernel_select(UTF8_KERNEL_AUTO);
+}
+
+void
+test_multi() {
+  char pool[32][80];
+  const char *ptrs[32];
+  size_t lens[32], i, n;
+  uint32_t exp_mask, got_mask;
+  int kernel, round;
+
+  for (kernel = UTF8_KERNEL_SCALAR; kernel < UTF8_KERNEL_COUNT; kernel++) {
+    if (!utf8_kernel_select((utf8_kernel_t)kernel))
+      continue;
+
+    for (round = 0; round < 20000; round++) {
+      n = random_u32() % 33;
+      exp_mask = 0;
+      for (i = 0; i < n; i++) {
+        lens[i] = random_u32() % 80;
+        switch (random_u32() % 3) {
+          case 0:
+            random_utf8(pool[i], lens[i]);
+            break;
+          case 1:
+            random_dirty_utf8(pool[i], lens[i], 1);
+            break;
+          default:
+            /* A sequence, possibly truncated, at the end of a lane */
+            random_utf8(pool[i], lens[i]);
+            if (lens[i])
+              pool[i][lens[i] - 1 - random_u32() % (lens[i] < 3 ? lens[i] : 3)]
+                = Boundaries[random_u32() % sizeof(Boundaries)];
+            break;
+        }
+        ptrs[i] = pool[i];
+        if (utf8_check_scalar(pool[i], lens[i], NULL))
+          exp_mask |= (uint32_t)1 << i;
+      }
+
+      got_mask = utf8_valid_multi(ptrs, lens, n);
+
+      TestCount++;
+      if (got_mask != exp_mask) {
+        printf("utf8_valid_multi(<%u strings>) with %s != 0x%08X (got: 0x%08X)\n",
+          (unsigned)n, utf8_kernel_name((utf8_kernel_t)kernel),
+          (unsigned)exp_mask, (unsigned)got_mask);
+        TestFailed++;
+      }
+    }
+  }
+  utf8_kernel_select(UTF8_KERNEL_AUTO);
+}
+
+void
+test_convert(const char *src, size_t len, unsigned line) {
+  char escaped[255 * 4 + 1];
+  uint32_t ords[255], *got32;
+  uint16_t exp16[255 * 2], *got16;
+  size_t i, n, exp_len, got_len, exp_cur, got_cur, got_count;
+  bool got_ret;
+
+  assert(len <= 255);
+
+  utf8_check(src, len, &exp_cur);
+  n = decode_ords(src, exp_cur, ords);
+  for (i = 0, exp_len = 0; i < n; i++) {
+    if (ords[i] < 0x10000)
+      exp16[exp_len++] = ords[i];
+    else {
+      exp16[exp_len++] = 0xD800 | (ords[i] - 0x10000) >> 10;
+      exp16[exp_len++] = 0xDC00 | (ords[i] & 0x3FF);
+    }
+  }
+
+  /* Exactly the documented room, the vector decoder must not store past it */
+  got16 = malloc(utf8_utf16_length(src, len) * sizeof(uint16_t));
+  got_len = utf8_to_utf16le(src, len, got16, &got_cur);
+
+  TestCount++;
+  if (got_cur != exp_cur || got_len != exp_len || memcmp(got16, exp16, exp_len * 2) != 0) {
+    escape_str(src, len, escaped);
+    printf("utf8_to_utf16le(\"%s\", %d) != %d units, cursor %d (got: %d units, cursor %d) at line %u\n",
+      escaped, (unsigned)len, (unsigned)exp_len, (unsigned)exp_cur,
+      (unsigned)got_len, (unsigned)got_cur, line);
+    TestFailed++;
+  }
+  free(got16);
+
+  got_len = utf8_utf16_length(src, exp_cur);
+  got_ret = utf8_check_utf16_length(src, len, &got_cur, &got_count);
+
+  TestCount++;
+  if (got_len != exp_len || got_ret != (exp_cur == len) || got_cur != exp_cur || got_count != exp_len) {
+    escape_str(src, len, escaped);
+    printf("utf8_check_utf16_length(\"%s\", %d) != %d units, cursor %d (got: %d/%d units, cursor %d) at line %u\n",
+      escaped, (unsigned)len, (unsigned)exp_len, (unsigned)exp_cur,
+      (unsigned)got_len, (unsigned)got_count, (unsigned)got_cur, line);
+    TestFailed++;
+  }
+
+  got_len = utf8_count_codepoints(src, exp_cur);
+  got_ret = utf8_check_count(src, len, &got_cur, &got_count);
+
+  TestCount++;
+  if (got_len != n || got_ret != (exp_cur == len) || got_cur != exp_cur || got_count != n) {
+    escape_str(src, len, escaped);
+    printf("utf8_check_count(\"%s\", %d) != %d code points, cursor %d (got: %d/%d code points, cursor %d) at line %u\n",
+      escaped, (unsigned)len, (unsigned)n, (unsigned)exp_cur,
+      (unsigned)got_len, (unsigned)got_count, (unsigned)got_cur, line);
+    TestFailed++;
+  }
+
+  got32 = malloc(utf8_count_codepoints(src, len) * sizeof(uint32_t));
+  got_len = utf8_to_utf32(src, len, got32, &got_cur);
+
+  TestCount++;
+  if (got_cur != exp_cur || got_len != n || memcmp(got32, ords, n * 4) != 0) {
+    escape_str(src, len, escaped);
+    printf("utf8_to_utf32(\"%s\", %d) != %d code points, cursor %d (got: %d code points, cursor %d) at line %u\n",
+      escaped, (unsigned)len, (unsigned)n, (unsigned)exp_cur,
+      (unsigned)got_len, (unsigned)got_cur, line);
+    TestFailed++;
+  }
+  free(got32);
+}
+
+void
+test_count_large() {
+  const size_t len = 1 << 16;
+  char *src;
+  size_t i, exp_count, exp_leads;
+
+  /*
+   * Long enough for the vector counters to sum their byte lanes several
+   * times, every byte value occurs.
+   */
+  src = malloc(len);
+  for (i = 0, exp_count = 0, exp_leads = 0; i < len; i++) {
+    src[i] = (char)random_u32();
+    exp_count += ((unsigned char)src[i] & 0xC0) != 0x80;
+    exp_leads += (unsigned char)src[i] >= 0xF0;
+  }
+
+  TestCount++;
+  if (utf8_count_codepoints(src, len) != exp_count) {
+    printf("utf8_count_codepoints(<%u random bytes>) != %u\n", (unsigned)len, (unsigned)exp_count);
+    TestFailed++;
+  }
+
+  TestCount++;
+  if (utf8_utf16_length(src, len) != exp_count + exp_leads) {
+    printf("utf8_utf16_length(<%u random bytes>) != %u\n", (unsigned)len, (unsigned)(exp_count + exp_leads));
+    TestFailed++;
+  }
+
+  free(src);
+}
+
+void
+test_conversions() {
+  char src[255];
+  uint32_t ord;
+  size_t len;
+
+  for (ord = 0; ord <= 0x10FFFF; ord++) {
+    if (ord == 0xD800)
+      ord = 0xE000;
+    len = ord < 0x80 ? 1 : ord < 0x800 ? 2 : ord < 0x10000 ? 3 : 4;
+    encode_ord(ord, len, src);
+    test_convert(src, len, __LINE__);
+  }
+
+  test_count_large();
+}
+
+void
+test_random_conversions() {
+  char src[255];
+  size_t i, len;
+
+  /*
+   * Every third string has no four byte sequence, which the vector decoder
+   * takes a whole window at a time.
+   */
+  for (i = 0; i < 20000; i++) {
+    len = random_u32() % 256;
+    random_utf8_max(src, len, i % 3 ? 4 : 3);
+    if (i % 2)
+      memset(src + len / 4, 'x', len / 2);
+    test_convert(src, len, __LINE__);
+  }
+}
+
+void
+test_sanitize() {
+  static char large[20000], large_exp[20000];
+  char src[255], exp[255 * 3], got[255 * 3], exp_inplace[255], escaped[255 * 4 + 1];
+  size_t i, len, off, cur, exp_len, got_len, cap, count;
+  bool ok;
+
+  for (i = 0; i < 20000; i++) {
+    len = random_u32() % 256;
+    random_dirty_utf8(src, len, 1 + random_u32() % 4);
+
+    for (off = 0, exp_len = 0;; ) {
+      ok = utf8_check_scalar(src + off, len - off, &cur);
+      memcpy(exp + exp_len, src + off, cur);
+      exp_len += cur;
+      off += cur;
+      if (ok)
+        break;
+      memcpy(exp + exp_len, "\xEF\xBF\xBD", 3);
+      exp_len += 3;
+      off += utf8_maximal_subpart(src + off, len - off);
+    }
+
+    got_len = utf8_sanitize(src, len, got, sizeof(got));
+
+    TestCount++;
+    if (got_len != exp_len || memcmp(got, exp, exp_len) != 0 ||
+        utf8_sanitize_length(src, len) != exp_len) {
+      escape_str(src, len, escaped);
+      printf("utf8_sanitize(\"%s\", %d) != %d bytes (got: %d bytes)\n",
+        escaped, (unsigned)len, (unsigned)exp_len, (unsigned)got_len);
+      TestFailed++;
+    }
+
+    /* In place, every byte of a maximal subpart is replaced */
+    memcpy(exp_inplace, src, len);
+    for (off = 0, count = 0; !utf8_check_scalar(src + off, len - off, &cur); count++) {
+      off += cur;
+      cur = utf8_maximal_subpart(src + off, len - off);
+      memset(exp_inplace + off, '?', cur);
+      off += cur;
+    }
+    memcpy(got, src, len);
+    got_len = utf8_sanitize_inplace(got, len, '?');
+
+    TestCount++;
+    if (got_len != count || memcmp(got, exp_inplace, len) != 0) {
+      escape_str(src, len, escaped);
+      printf("utf8_sanitize_inplace(\"%s\", %d) != %d subparts (got: %d subparts)\n",
+        escaped, (unsigned)len, (unsigned)count, (unsigned)got_len);
+      TestFailed++;
+    }
+
+    /* Output that does not fit is cut at a sequence boundary */
+    cap = random_u32() % (exp_len + 1);
+    got_len = utf8_sanitize(src, len, got, cap);
+
+    TestCount++;
+    if (got_len != utf8_resync(exp, exp_len, cap) || memcmp(got, exp, got_len) != 0) {
+      escape_str(src, len, escaped);
+      printf("utf8_sanitize(\"%s\", %d, %d) != %d bytes (got: %d bytes)\n",
+        escaped, (unsigned)len, (unsigned)cap,
+        (unsigned)utf8_resync(exp, exp_len, cap), (unsigned)got_len);
+      TestFailed++;
+    }
+  }
+
+  /* In place across the blocks and chunks of the kernels */
+  for (i = 0; i < 200; i++) {
+    len = random_u32() % sizeof(large);
+    random_dirty_utf8(large, len, random_u32() % (1 + len / (1 + i % 4 * 500)));
+    memcpy(large_exp, large, len);
+    for (off = 0, count = 0; !utf8_check_scalar(large + off, len - off, &cur); count++) {
+      off += cur;
+      cur = utf8_maximal_subpart(large + off, len - off);
+      memset(large_exp + off, '?', cur);
+      off += cur;
+    }
+    got_len = utf8_sanitize_inplace(large, len, '?');
+
+    TestCount++;
+    if (got_len != count || memcmp(large, large_exp, len) != 0) {
+      printf("utf8_sanitize_inplace(\"...\", %d) != %d subparts (got: %d subparts) [%s]\n",
+        (unsigned)len, (unsigned)count, (unsigned)got_len, utf8_kernel_name(utf8_kernel()));
+      TestFailed++;
+    }
+  }
+}
+
+void
+test_find_errors_against_scalar(const char *src, size_t len, size_t max) {
+  static utf8_error_t exp[20000], got[20000];
+  char escaped[255 * 4 + 1];
+  size_t j, off, cur, exp_count, got_count;
+
+  for (off = 0, exp_count = 0; !utf8_check_scalar(src + off, len - off, &cur); exp_count++) {
+    off += cur;
+    exp[exp_count].offset = off;
+    exp[exp_count].length = utf8_maximal_subpart(src + off, len - off);
+    off += exp[exp_count].length;
+  }
+  if (max > exp_count)
+    max = exp_count;
+
+  got_count = utf8_find_errors(src, len, got, max);
+
+  /*
+   * Every ill-formed sequence has a kind, and only a truncated sequence
+   * has a maximal subpart longer than its lead byte.
+   */
+  TestCount++;
+  for (j = 0; j < max && got_count == exp_count; j++) {
+    if (got[j].offset != exp[j].offset || got[j].length != exp[j].length)
+      break;
+    if (got[j].kind == UTF8_ERROR_NONE)
+      break;
+    if (got[j].kind != UTF8_ERROR_TRUNCATED && got[j].length != 1)
+      break;
+  }
+  if (got_count != exp_count || j != max) {
+    if (len <= 255)
+      escape_str(src, len, escaped);
+    else
+      strcpy(escaped, "...");
+    printf("utf8_find_errors(\"%s\", %d, %d) != %d errors (got: %d errors, mismatch at %d) [%s]\n",
+      escaped, (unsigned)len, (unsigned)max, (unsigned)exp_count, (unsigned)got_count, (unsigned)j,
+      utf8_kernel_name(utf8_kernel()));
+    TestFailed++;
+  }
+}
+
+void
+test_find_errors() {
+  static char large[20000];
+  char src[255];
+  size_t i, len;
+
+  for (i = 0; i < 20000; i++) {
+    len = random_u32() % 256;
+    random_dirty_utf8(src, len, 1 + random_u32() % 4);
+    test_find_errors_against_scalar(src, len, i % 2 ? len : random_u32() % (len + 1));
+  }
+
+  /* Errors from dense to sparse, across the blocks and chunks of the kernels */
+  for (i = 0; i < 200; i++) {
+    len = random_u32() % sizeof(large);
+    random_dirty_utf8(large, len, random_u32() % (1 + len / (1 + i % 4 * 500)));
+    test_find_errors_against_scalar(large, len, len);
+  }
+}
+
+void
+test_error_kinds() {
+  static const struct {
+    const char *src;
+    utf8_error_kind_t kind;
+  } kCases[] = {
+    { "",                 UTF8_ERROR_NONE         },
+    { "A",                UTF8_ERROR_NONE         },
+    { "\xC3\xA5",         UTF8_ERROR_NONE         },
+    { "\xF4\x8F\xBF\xBF", UTF8_ERROR_NONE         },
+    { "\xE0\x80\x80",     UTF8_ERROR_OVERLONG     },
+    { "\xE0\x9F\xBF",     UTF8_ERROR_OVERLONG     },
+    { "\xF0\x80\x80\x80", UTF8_ERROR_OVERLONG     },
+    { "\xF0\x8F\xBF\xBF", UTF8_ERROR_OVERLONG     },
+    { "\xED\xA0\x80",     UTF8_ERROR_SURROGATE    },
+    { "\xED\xBF\xBF",     UTF8_ERROR_SURROGATE    },
+    { "\xF4\x90\x80\x80", UTF8_ERROR_TOO_LARGE    },
+    { "\xF4\xBF\xBF\xBF", UTF8_ERROR_TOO_LARGE    },
+    { "\x80",             UTF8_ERROR_CONTINUATION },
+    { "\xBF\x80",         UTF8_ERROR_CONTINUATION },
+    { "\xC2",             UTF8_ERROR_TRUNCATED    },
+    { "\xC2\x41",         UTF8_ERROR_TRUNCATED    },
+    { "\xE1\x80",         UTF8_ERROR_TRUNCATED    },
+    { "\xE1\x80\xC0",     UTF8_ERROR_TRUNCATED    },
+    { "\xE0\xA0",         UTF8_ERROR_TRUNCATED    },
+    { "\xF1\x80\x80",     UTF8_ERROR_TRUNCATED    },
+    { "\xF4\x8F\xBF\x41", UTF8_ERROR_TRUNCATED    },
+    { "\xE0\x41",         UTF8_ERROR_TRUNCATED    },
+    { "\xC0\x80",         UTF8_ERROR_INVALID_LEAD },
+    { "\xC1\xBF",         UTF8_ERROR_INVALID_LEAD },
+    { "\xF5\x80\x80\x80", UTF8_ERROR_INVALID_LEAD },
+    { "\xFF",             UTF8_ERROR_INVALID_LEAD },
+  };
+  char src[16], escaped[16 * 4 + 1];
+  utf8_error_t error;
+  size_t i, len;
+  bool ok;
+
+  /* Each case follows a well-formed prefix, the error is at its end */
+  for (i = 0; i < sizeof(kCases) / sizeof(kCases[0]); i++) {
+    len = strlen(kCases[i].src);
+    memcpy(src, "ab\xC3\xA5", 4);
+    memcpy(src + 4, kCases[i].src, len);
+    len += 4;
+
+    error.kind = UTF8_ERROR_NONE;
+    ok = utf8_check_error(src, len, &error);
+
+    TestCount++;
+    if (ok != (kCases[i].kind == UTF8_ERROR_NONE) || error.kind != kCases[i].kind ||
+        (!ok && error.offset != 4)) {
+      escape_str(src, len, escaped);
+      printf("utf8_check_error(\"%s\", %d) != %s (got: %s at %d)\n",
+        escaped, (unsigned)len, utf8_error_name(kCases[i].kind),
+        utf8_error_name(error.kind), ok ? 0 : (unsigned)error.offset);
+      TestFailed++;
+    }
+  }
+}
+
+void
+test_kernel_dispatch() {
+  int kernel;
+
+  TestCount++;
+  if (!utf8_kernel_select(UTF8_KERNEL_AUTO) || utf8_kernel() == UTF8_KERNEL_AUTO) {
+    printf("utf8_kernel_select(UTF8_KERNEL_AUTO) did not select a kernel\n");
+    TestFailed++;
+  }
+
+  /* Without a vector kernel the fallback is selected */
+  for (kernel = UTF8_KERNEL_SSE4; kernel <= UTF8_KERNEL_AVX512; kernel++) {
+    if (utf8_kernel_supported((utf8_kernel_t)kernel))
+      break;
+  }
+  TestCount++;
+  if (kernel > UTF8_KERNEL_AVX512 && utf8_kernel() != UTF8_KERNEL_FALLBACK) {
+    printf("utf8_kernel_select(UTF8_KERNEL_AUTO) selected %s, not %s\n",
+      utf8_kernel_name(utf8_kernel()), utf8_kernel_name(UTF8_KERNEL_FALLBACK));
+    TestFailed++;
+  }
+
+  for (kernel = UTF8_KERNEL_SCALAR; kernel < UTF8_KERNEL_COUNT; kernel++) {
+    if (utf8_kernel_supported((utf8_kernel_t)kernel))
+      continue;
+
+    TestCount++;
+    if (utf8_kernel_select((utf8_kernel_t)kernel) || utf8_kernel() == kernel) {
+      printf("utf8_kernel_select(%s) selected an unsupported kernel\n",
+        utf8_kernel_name((utf8_kernel_t)kernel));
+      TestFailed++;
+    }
+  }
+}
 
 void
 test_unicode_scalar_value() {
@@ -174,7 +975,7 @@ test_unicode_scalar_value() {
 
     TEST_UTF8(src, 3, 0, true);
     if ((ord % (1 << 6)) == 0)
-      TEST_UTF8(src, 2, 2, false);
+      TEST_UTF8_INCOMPLETE(src, 2, 2);
   }
 
   /*
@@ -186,9 +987,9 @@ test_unicode_scalar_value() {
 
     TEST_UTF8(src, 4, 0, true);
     if ((ord % (1 << 6)) == 0)
-      TEST_UTF8(src, 3, 3, false);
+      TEST_UTF8_INCOMPLETE(src, 3, 3);
     if ((ord % (1 << 12)) == 0)
-      TEST_UTF8(src, 2, 2, false);
+      TEST_UTF8_INCOMPLETE(src, 2, 2);
   }
 }
 
@@ -288,12 +1089,37 @@ test_continuations() {
 
 int
 main(int argc, char **argv) {
+  int kernel;
+
+  for (kernel = UTF8_KERNEL_SCALAR; kernel < UTF8_KERNEL_COUNT; kernel++) {
+    if (!utf8_kernel_select((utf8_kernel_t)kernel))
+      continue;
+
+    test_unicode_scalar_value();
+    test_surrogates();
+    test_non_shortest_form();
+    test_non_unicode();
+    test_continuations();
+    test_ascii_runs();
+    test_stream();
+    test_sanitize();
+    test_find_errors();
+    test_random_conversions();
+
+    if (kernel != UTF8_KERNEL_SCALAR)
+      test_kernel(utf8_kernel_name((utf8_kernel_t)kernel),
+        utf8_kernel_function((utf8_kernel_t)kernel));
+  }
+
+  utf8_kernel_select(UTF8_KERNEL_AUTO);
+  test_kernel("dispatch", utf8_check);
 
-  test_unicode_scalar_value();
-  test_surrogates();
-  test_non_shortest_form();
-  test_non_unicode();
-  test_continuations();
+  test_kernel_dispatch();
+  test_conversions();
+  test_error_kinds();
+  test_parallel();
+  test_batch();
+  test_multi();
 
   if (TestFailed)
     printf("Failed %zu tests of %zu.\n", TestFailed, TestCount);
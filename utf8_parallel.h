@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2017 Christian Hansen <chansen@cpan.org>
+ * <https://github.com/chansen/c-utf8-valid>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef UTF8_PARALLEL_H
+#define UTF8_PARALLEL_H
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "utf8_valid.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ *    Parallel validation
+ *
+ *    The input is cut into chunks at positions found by utf8_resync, and
+ *    the chunks are validated with utf8_check by a pool of threads that
+ *    claim them in order. Once a chunk fails, chunks after it are no
+ *    longer claimed, the cursor is that of the first failing chunk.
+ *
+ *    Input shorter than two chunks of UTF8_PARALLEL_MIN_CHUNK bytes is
+ *    validated on the calling thread.
+ */
+
+#ifndef UTF8_PARALLEL_MIN_CHUNK
+#define UTF8_PARALLEL_MIN_CHUNK (1 << 20)
+#endif
+
+#ifndef UTF8_PARALLEL_CHUNKS_PER_THREAD
+#define UTF8_PARALLEL_CHUNKS_PER_THREAD 4
+#endif
+
+typedef struct {
+  const char *src;
+  size_t len;
+  size_t chunk;
+  size_t nchunks;
+  size_t next;
+  size_t failed;
+  size_t cursor;
+  pthread_mutex_t lock;
+} utf8_parallel_t;
+
+static void *
+utf8_parallel_worker(void *arg) {
+  utf8_parallel_t *p = (utf8_parallel_t *)arg;
+  size_t i, begin, end, cur;
+
+  for (;;) {
+    pthread_mutex_lock(&p->lock);
+    i = p->next++;
+    if (i >= p->nchunks || i > p->failed) {
+      pthread_mutex_unlock(&p->lock);
+      break;
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    begin = utf8_resync(p->src, p->len, i * p->chunk);
+    end = i + 1 == p->nchunks ? p->len : utf8_resync(p->src, p->len, (i + 1) * p->chunk);
+
+    if (!utf8_check(p->src + begin, end - begin, &cur)) {
+      pthread_mutex_lock(&p->lock);
+      if (i < p->failed) {
+        p->failed = i;
+        p->cursor = begin + cur;
+      }
+      pthread_mutex_unlock(&p->lock);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Validates with the given number of threads, including the calling thread.
+ * A thread count of zero uses one thread per online CPU.
+ */
+bool
+utf8_check_parallel(const char *src, size_t len, unsigned nthreads, size_t *cursor) {
+  utf8_parallel_t p;
+  pthread_t *threads;
+  unsigned i, n;
+
+  if (nthreads == 0) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = ncpu > 0 ? (unsigned)ncpu : 1;
+  }
+
+  if (nthreads > len / UTF8_PARALLEL_MIN_CHUNK)
+    nthreads = (unsigned)(len / UTF8_PARALLEL_MIN_CHUNK);
+
+  if (nthreads < 2)
+    return utf8_check(src, len, cursor);
+
+  p.src = src;
+  p.len = len;
+  p.nchunks = (size_t)nthreads * UTF8_PARALLEL_CHUNKS_PER_THREAD;
+  if (p.nchunks > len / UTF8_PARALLEL_MIN_CHUNK)
+    p.nchunks = len / UTF8_PARALLEL_MIN_CHUNK;
+  p.chunk = len / p.nchunks;
+  p.next = 0;
+  p.failed = p.nchunks;
+  p.cursor = len;
+  pthread_mutex_init(&p.lock, NULL);
+
+  /* Resolve the kernel before the threads race to do it */
+  utf8_kernel();
+
+  threads = (pthread_t *)malloc(sizeof(pthread_t) * (nthreads - 1));
+  for (n = 0; threads && n < nthreads - 1; n++) {
+    if (pthread_create(&threads[n], NULL, utf8_parallel_worker, &p) != 0)
+      break;
+  }
+
+  utf8_parallel_worker(&p);
+
+  for (i = 0; i < n; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+  pthread_mutex_destroy(&p.lock);
+
+  if (cursor)
+    *cursor = p.cursor;
+  return p.failed == p.nchunks;
+}
+
+bool
+utf8_valid_parallel(const char *src, size_t len, unsigned nthreads) {
+  return utf8_check_parallel(src, len, nthreads, NULL);
+}
+
+#ifdef __cplusplus
+}
+#endif
+#endif
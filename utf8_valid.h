@@ -30,6 +30,11 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(UTF8_VALID_NO_SIMD)
+#define UTF8_VALID_X86 1
+#include <immintrin.h>
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -62,31 +67,123 @@ extern "C" {
  *    S = Surrogates
  */
 
+/*
+ * Returns the length of the sequence introduced by the given lead byte,
+ * ASCII and continuation bytes count as sequences of one byte.
+ */
+static inline size_t
+utf8_sequence_length(unsigned char c) {
+  return c < 0xC0 ? 1 : c < 0xE0 ? 2 : c < 0xF0 ? 3 : 4;
+}
+
+/* Inputs shorter than this are probed for ASCII first, at most 32 */
+#ifndef UTF8_VALID_SHORT
+#define UTF8_VALID_SHORT 32
+#endif
+
+/*
+ * Returns true if the n < 32 bytes at src are all ASCII. Two overlapping
+ * loads of a fixed size cover any length in a power of two range, so
+ * there is no loop and no per-byte bounds check.
+ */
+static inline bool
+utf8_ascii_short(const unsigned char *src, size_t n) {
+  const uint64_t mask = UINT64_C(0x8080808080808080);
+  uint64_t w0, w1, w2, w3;
+  uint32_t h0, h1;
+
+  if (n >= 16) {
+    memcpy(&w0, src, 8);
+    memcpy(&w1, src + 8, 8);
+    memcpy(&w2, src + n - 16, 8);
+    memcpy(&w3, src + n - 8, 8);
+    return ((w0 | w1 | w2 | w3) & mask) == 0;
+  }
+  if (n >= 8) {
+    memcpy(&w0, src, 8);
+    memcpy(&w1, src + n - 8, 8);
+    return ((w0 | w1) & mask) == 0;
+  }
+  if (n >= 4) {
+    memcpy(&h0, src, 4);
+    memcpy(&h1, src + n - 4, 4);
+    return ((h0 | h1) & 0x80808080) == 0;
+  }
+  if (n > 0)
+    return ((src[0] | src[n >> 1] | src[n - 1]) & 0x80) == 0;
+  return true;
+}
+
+/*
+ * Copies n < 16 bytes to dst with overlapping copies of a fixed size,
+ * which avoid the call and branches of a variable length memcpy.
+ */
+static inline void
+utf8_copy_short(unsigned char *dst, const unsigned char *src, size_t n) {
+  if (n >= 8) {
+    memcpy(dst, src, 8);
+    memcpy(dst + n - 8, src + n - 8, 8);
+  }
+  else if (n >= 4) {
+    memcpy(dst, src, 4);
+    memcpy(dst + n - 4, src + n - 4, 4);
+  }
+  else if (n > 0) {
+    dst[0] = src[0];
+    dst[n >> 1] = src[n >> 1];
+    dst[n - 1] = src[n - 1];
+  }
+}
+
+/*
+ * Skips a run of ASCII bytes a word at a time. An unaligned probe of the
+ * next eight bytes keeps the cost low on text where ASCII bytes are
+ * mixed with other characters, longer runs are then read sixteen bytes
+ * at a time with aligned loads. Returns a pointer to at most sixteen
+ * bytes before the first byte with the high bit set.
+ */
+static inline const unsigned char *
+utf8_skip_ascii(const unsigned char *cur, const unsigned char *end) {
+  const uint64_t mask = UINT64_C(0x8080808080808080);
+  const unsigned char *aligned;
+  uint64_t w0, w1;
+
+  if (end - cur < 8)
+    return cur;
+
+  memcpy(&w0, cur, 8);
+  if (w0 & mask)
+    return cur;
+
+  aligned = cur + 8 - ((uintptr_t)cur & 7);
+  if (end - aligned < 16)
+    return aligned;
+
+  for (cur = aligned; end - cur >= 16; cur += 16) {
+    memcpy(&w0, cur, 8);
+    memcpy(&w1, cur + 8, 8);
+    if ((w0 | w1) & mask)
+      break;
+  }
+  return cur;
+}
+
 bool
-utf8_check(const char *src, size_t len, size_t *cursor) {
+utf8_check_scalar(const char *src, size_t len, size_t *cursor) {
   const unsigned char *cur = (const unsigned char *)src;
   const unsigned char *end = cur + len;
-  const unsigned char *p;
-  unsigned char buf[4];
   uint32_t v;
 
-  for (p = cur;;) {
-    if (cur >= end - 3) {
-      if (cur == end)
-        break;
-      memset(buf, 0, 4);
-      memcpy(buf, cur, end - cur);
-      p = (const unsigned char *)buf;
-    }
-
-    v = p[0];
+  /* At least 4 bytes remain, any sequence can be read without bounds checks */
+  while (end - cur >= 4) {
+    v = cur[0];
     /* 0xxxxxxx */
     if ((v & 0x80) == 0) {
-      cur += 1;
+      cur = utf8_skip_ascii(cur + 1, end);
       continue;
     }
 
-    v = (v << 8) | p[1];
+    v = (v << 8) | cur[1];
     /* 110xxxxx 10xxxxxx */
     if ((v & 0xE0C0) == 0xC080) {
       /* Ensure that the top 4 bits is not zero */
@@ -97,7 +194,7 @@ utf8_check(const char *src, size_t len, size_t *cursor) {
       continue;
     }
 
-    v = (v << 8) | p[2];
+    v = (v << 8) | cur[2];
     /* 1110xxxx 10xxxxxx 10xxxxxx */
     if ((v & 0xF0C0C0) == 0xE08080) {
       /* Ensure that the top 5 bits is not zero and not a surrogate */
@@ -108,7 +205,7 @@ utf8_check(const char *src, size_t len, size_t *cursor) {
       continue;
     }
 
-    v = (v << 8) | p[3];
+    v = (v << 8) | cur[3];
     /* 11110xxx 10xxxxxx 10xxxxxx 10xxxxxx */
     if ((v & 0xF8C0C0C0) == 0xF0808080) {
       /* Ensure that the top 5 bits is not zero and not out of range */
@@ -122,57 +219,2530 @@ utf8_check(const char *src, size_t len, size_t *cursor) {
     break;
   }
 
+  /*
+   * At most 3 bytes remain, a 4 byte sequence can't fit. An ill-formed
+   * sequence from the loop above fails the same checks here.
+   */
+  while (cur < end) {
+    v = cur[0];
+    if ((v & 0x80) == 0) {
+      cur++;
+      continue;
+    }
+
+    if (end - cur < 2)
+      break;
+    v = (v << 8) | cur[1];
+    if ((v & 0xE0C0) == 0xC080) {
+      if ((v & 0x1E00) == 0)
+        break;
+      cur += 2;
+      continue;
+    }
+
+    if (end - cur < 3)
+      break;
+    v = (v << 8) | cur[2];
+    if ((v & 0xF0C0C0) == 0xE08080) {
+      v = v & 0x0F2000;
+      if (v == 0 || v == 0x0D2000)
+        break;
+      cur += 3;
+      continue;
+    }
+
+    break;
+  }
+
   if (cursor)
     *cursor = (const char *)cur - src;
 
   return cur == end;
 }
 
+/*
+ *    Table-driven DFA
+ *
+ *    An alternative to the scalar decoder in the style of Hoehrmann's
+ *    decoder. Every byte is mapped to one of twelve classes, and the class
+ *    and the current state select the next state, so the inner loop has
+ *    no branches that depend on the input. States are premultiplied by the
+ *    number of classes. The reject state is absorbing, and the cursor is
+ *    the end of the last byte that left the DFA in the accept state.
+ */
+
+#define UTF8_DFA_ACCEPT  0
+#define UTF8_DFA_REJECT 12
+
+static const unsigned char utf8_dfa_class[256] = {
+  /* 00 */  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+  /* 10 */  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+  /* 20 */  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+  /* 30 */  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+  /* 40 */  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+  /* 50 */  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+  /* 60 */  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+  /* 70 */  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+  /* 80 */  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,
+  /* 90 */  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,
+  /* A0 */  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,
+  /* B0 */  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,
+  /* C0 */  4,  4,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,
+  /* D0 */  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,
+  /* E0 */  6,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  8,  7,  7,
+  /* F0 */  9, 10, 10, 10, 11,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,
+};
+
+static const unsigned char utf8_dfa_transition[9 * 12] = {
+  /*           00  80  90  A0  C0  C2  E0  E1  ED  F0  F1  F4 */
+  /*           7F  8F  9F  BF  C1  DF      EF          F3     */
+  /* accept */  0, 12, 12, 12, 12, 24, 48, 36, 60, 84, 72, 96,
+  /* reject */ 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12,
+  /* 1 left */ 12,  0,  0,  0, 12, 12, 12, 12, 12, 12, 12, 12,
+  /* 2 left */ 12, 24, 24, 24, 12, 12, 12, 12, 12, 12, 12, 12,
+  /* E0     */ 12, 12, 12, 24, 12, 12, 12, 12, 12, 12, 12, 12,
+  /* ED     */ 12, 24, 24, 12, 12, 12, 12, 12, 12, 12, 12, 12,
+  /* 3 left */ 12, 36, 36, 36, 12, 12, 12, 12, 12, 12, 12, 12,
+  /* F0     */ 12, 12, 36, 36, 12, 12, 12, 12, 12, 12, 12, 12,
+  /* F4     */ 12, 36, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12,
+};
+
+/*
+ * Returns the same result and cursor as utf8_check_scalar. Runs of ASCII
+ * are skipped whenever the DFA is in the accept state at the start of a
+ * block of 64 bytes, and the reject state is tested once per block.
+ */
 bool
-utf8_valid(const char *src, size_t len) {
-  return utf8_check(src, len, NULL);
+utf8_check_dfa(const char *src, size_t len, size_t *cursor) {
+  const unsigned char *cur = (const unsigned char *)src;
+  const unsigned char *end = cur + len;
+  const unsigned char *accept = cur;
+  const unsigned char *block;
+  unsigned state = UTF8_DFA_ACCEPT;
+
+  while (cur < end) {
+    if (state == UTF8_DFA_ACCEPT)
+      accept = cur = utf8_skip_ascii(cur, end);
+
+    block = end - cur > 64 ? cur + 64 : end;
+    for (; cur < block; cur++) {
+      state = utf8_dfa_transition[state + utf8_dfa_class[*cur]];
+      accept = state == UTF8_DFA_ACCEPT ? cur + 1 : accept;
+    }
+
+    if (state == UTF8_DFA_REJECT)
+      break;
+  }
+
+  if (cursor)
+    *cursor = (const char *)accept - src;
+
+  return state == UTF8_DFA_ACCEPT;
 }
 
-size_t
-utf8_maximal_subpart(const char *src, size_t len) {
-  const unsigned char *cur = (const unsigned char *)src;
-  uint32_t v;
+/*
+ *    Shift DFA
+ *
+ *    The same automaton as the table-driven DFA with states encoded as bit
+ *    offsets, multiples of six. The word for a byte packs the next state
+ *    of every state, so a transition is one load, which does not depend
+ *    on the state, and one shift. The input is split into four segments
+ *    at sequence boundaries, which are run interleaved so that the four
+ *    dependency chains overlap. Each segment keeps the start of its last
+ *    block that began in the accept state, and a segment that does not end
+ *    in the accept state is run again from there, keeping the end of the
+ *    last complete sequence, for the exact cursor.
+ */
 
-  if (len < 2)
-    return len;
+#define UTF8_SHIFT_ACCEPT  0
+#define UTF8_SHIFT_REJECT  6
+#define UTF8_SHIFT_1_LEFT 12
+#define UTF8_SHIFT_2_LEFT 18
+#define UTF8_SHIFT_E0     24
+#define UTF8_SHIFT_ED     30
+#define UTF8_SHIFT_3_LEFT 36
+#define UTF8_SHIFT_F0     42
+#define UTF8_SHIFT_F4     48
 
-  v = (cur[0] << 8) | cur[1];
-  if ((v & 0xC0C0) != 0xC080)
-    return 1;
+/* Next state from accept, 1 left, 2 left, E0, ED, 3 left, F0 and F4, reject stays */
+#define UTF8_SHIFT_ROW(a, l1, l2, e0, ed, l3, f0, f4) (          \
+    (uint64_t)(a)  << UTF8_SHIFT_ACCEPT                          \
+  | (uint64_t)UTF8_SHIFT_REJECT << UTF8_SHIFT_REJECT             \
+  | (uint64_t)(l1) << UTF8_SHIFT_1_LEFT                          \
+  | (uint64_t)(l2) << UTF8_SHIFT_2_LEFT                          \
+  | (uint64_t)(e0) << UTF8_SHIFT_E0                              \
+  | (uint64_t)(ed) << UTF8_SHIFT_ED                              \
+  | (uint64_t)(l3) << UTF8_SHIFT_3_LEFT                          \
+  | (uint64_t)(f0) << UTF8_SHIFT_F0                              \
+  | (uint64_t)(f4) << UTF8_SHIFT_F4)
 
-  if ((v & 0x2000) == 0) {
-    v = v & 0x1E00;
-    if (v == 0)
-      return 1;
-    return 2;
+#define UTF8_R UTF8_SHIFT_REJECT
+
+/* 00..7F */
+#define UTF8_SD_00 UTF8_SHIFT_ROW(0, UTF8_R, UTF8_R, UTF8_R, UTF8_R, UTF8_R, UTF8_R, UTF8_R)
+/* 80..8F */
+#define UTF8_SD_80 UTF8_SHIFT_ROW(UTF8_R, 0, UTF8_SHIFT_1_LEFT, UTF8_R, UTF8_SHIFT_1_LEFT, \
+                                  UTF8_SHIFT_2_LEFT, UTF8_R, UTF8_SHIFT_2_LEFT)
+/* 90..9F */
+#define UTF8_SD_90 UTF8_SHIFT_ROW(UTF8_R, 0, UTF8_SHIFT_1_LEFT, UTF8_R, UTF8_SHIFT_1_LEFT, \
+                                  UTF8_SHIFT_2_LEFT, UTF8_SHIFT_2_LEFT, UTF8_R)
+/* A0..BF */
+#define UTF8_SD_A0 UTF8_SHIFT_ROW(UTF8_R, 0, UTF8_SHIFT_1_LEFT, UTF8_SHIFT_1_LEFT, UTF8_R, \
+                                  UTF8_SHIFT_2_LEFT, UTF8_SHIFT_2_LEFT, UTF8_R)
+/* C0..C1, F5..FF */
+#define UTF8_SD_C0 UTF8_SHIFT_ROW(UTF8_R, UTF8_R, UTF8_R, UTF8_R, UTF8_R, UTF8_R, UTF8_R, UTF8_R)
+/* C2..DF, E0, E1..EC and EE..EF, ED, F0, F1..F3, F4 */
+#define UTF8_SD_C2 UTF8_SHIFT_ROW(UTF8_SHIFT_1_LEFT, UTF8_R, UTF8_R, UTF8_R, UTF8_R, UTF8_R, UTF8_R, UTF8_R)
+#define UTF8_SD_E0 UTF8_SHIFT_ROW(UTF8_SHIFT_E0,     UTF8_R, UTF8_R, UTF8_R, UTF8_R, UTF8_R, UTF8_R, UTF8_R)
+#define UTF8_SD_E1 UTF8_SHIFT_ROW(UTF8_SHIFT_2_LEFT, UTF8_R, UTF8_R, UTF8_R, UTF8_R, UTF8_R, UTF8_R, UTF8_R)
+#define UTF8_SD_ED UTF8_SHIFT_ROW(UTF8_SHIFT_ED,     UTF8_R, UTF8_R, UTF8_R, UTF8_R, UTF8_R, UTF8_R, UTF8_R)
+#define UTF8_SD_F0 UTF8_SHIFT_ROW(UTF8_SHIFT_F0,     UTF8_R, UTF8_R, UTF8_R, UTF8_R, UTF8_R, UTF8_R, UTF8_R)
+#define UTF8_SD_F1 UTF8_SHIFT_ROW(UTF8_SHIFT_3_LEFT, UTF8_R, UTF8_R, UTF8_R, UTF8_R, UTF8_R, UTF8_R, UTF8_R)
+#define UTF8_SD_F4 UTF8_SHIFT_ROW(UTF8_SHIFT_F4,     UTF8_R, UTF8_R, UTF8_R, UTF8_R, UTF8_R, UTF8_R, UTF8_R)
+
+static const uint64_t utf8_shift_dfa[256] = {
+  UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00,
+  UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00,
+  UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00,
+  UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00,
+  UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00,
+  UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00,
+  UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00,
+  UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00,
+  UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00,
+  UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00,
+  UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00,
+  UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00,
+  UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00,
+  UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00,
+  UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00,
+  UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00, UTF8_SD_00,
+  UTF8_SD_80, UTF8_SD_80, UTF8_SD_80, UTF8_SD_80, UTF8_SD_80, UTF8_SD_80, UTF8_SD_80, UTF8_SD_80,
+  UTF8_SD_80, UTF8_SD_80, UTF8_SD_80, UTF8_SD_80, UTF8_SD_80, UTF8_SD_80, UTF8_SD_80, UTF8_SD_80,
+  UTF8_SD_90, UTF8_SD_90, UTF8_SD_90, UTF8_SD_90, UTF8_SD_90, UTF8_SD_90, UTF8_SD_90, UTF8_SD_90,
+  UTF8_SD_90, UTF8_SD_90, UTF8_SD_90, UTF8_SD_90, UTF8_SD_90, UTF8_SD_90, UTF8_SD_90, UTF8_SD_90,
+  UTF8_SD_A0, UTF8_SD_A0, UTF8_SD_A0, UTF8_SD_A0, UTF8_SD_A0, UTF8_SD_A0, UTF8_SD_A0, UTF8_SD_A0,
+  UTF8_SD_A0, UTF8_SD_A0, UTF8_SD_A0, UTF8_SD_A0, UTF8_SD_A0, UTF8_SD_A0, UTF8_SD_A0, UTF8_SD_A0,
+  UTF8_SD_A0, UTF8_SD_A0, UTF8_SD_A0, UTF8_SD_A0, UTF8_SD_A0, UTF8_SD_A0, UTF8_SD_A0, UTF8_SD_A0,
+  UTF8_SD_A0, UTF8_SD_A0, UTF8_SD_A0, UTF8_SD_A0, UTF8_SD_A0, UTF8_SD_A0, UTF8_SD_A0, UTF8_SD_A0,
+  UTF8_SD_C0, UTF8_SD_C0, UTF8_SD_C2, UTF8_SD_C2, UTF8_SD_C2, UTF8_SD_C2, UTF8_SD_C2, UTF8_SD_C2,
+  UTF8_SD_C2, UTF8_SD_C2, UTF8_SD_C2, UTF8_SD_C2, UTF8_SD_C2, UTF8_SD_C2, UTF8_SD_C2, UTF8_SD_C2,
+  UTF8_SD_C2, UTF8_SD_C2, UTF8_SD_C2, UTF8_SD_C2, UTF8_SD_C2, UTF8_SD_C2, UTF8_SD_C2, UTF8_SD_C2,
+  UTF8_SD_C2, UTF8_SD_C2, UTF8_SD_C2, UTF8_SD_C2, UTF8_SD_C2, UTF8_SD_C2, UTF8_SD_C2, UTF8_SD_C2,
+  UTF8_SD_E0, UTF8_SD_E1, UTF8_SD_E1, UTF8_SD_E1, UTF8_SD_E1, UTF8_SD_E1, UTF8_SD_E1, UTF8_SD_E1,
+  UTF8_SD_E1, UTF8_SD_E1, UTF8_SD_E1, UTF8_SD_E1, UTF8_SD_E1, UTF8_SD_ED, UTF8_SD_E1, UTF8_SD_E1,
+  UTF8_SD_F0, UTF8_SD_F1, UTF8_SD_F1, UTF8_SD_F1, UTF8_SD_F4, UTF8_SD_C0, UTF8_SD_C0, UTF8_SD_C0,
+  UTF8_SD_C0, UTF8_SD_C0, UTF8_SD_C0, UTF8_SD_C0, UTF8_SD_C0, UTF8_SD_C0, UTF8_SD_C0, UTF8_SD_C0,
+};
+
+#undef UTF8_R
+#undef UTF8_SD_00
+#undef UTF8_SD_80
+#undef UTF8_SD_90
+#undef UTF8_SD_A0
+#undef UTF8_SD_C0
+#undef UTF8_SD_C2
+#undef UTF8_SD_E0
+#undef UTF8_SD_E1
+#undef UTF8_SD_ED
+#undef UTF8_SD_F0
+#undef UTF8_SD_F1
+#undef UTF8_SD_F4
+
+#define UTF8_SHIFT_STEP(state, c) ((utf8_shift_dfa[c] >> (state)) & 63)
+
+/* Inputs shorter than this are run as a single segment */
+#ifndef UTF8_SHIFT_DFA_SPLIT
+#define UTF8_SHIFT_DFA_SPLIT 256
+#endif
+
+size_t utf8_resync(const char *src, size_t len, size_t pos);
+size_t utf8_maximal_subpart(const char *src, size_t len);
+
+/* Receives the offset and length of every maximal subpart found by a scan */
+typedef void (*utf8_scan_fn)(void *ctx, size_t offset, size_t length);
+
+/*
+ * Runs the bytes from cur to end from the given state, stopping early
+ * once the reject state is reached. Runs of ASCII are skipped between
+ * sequences, and mark is moved to every block that begins in the accept
+ * state.
+ */
+static inline unsigned
+utf8_shift_dfa_run(const unsigned char *cur, const unsigned char *end, unsigned state,
+                   const unsigned char **mark) {
+  const unsigned char *block;
+
+  while (cur < end && state != UTF8_SHIFT_REJECT) {
+    if (state == UTF8_SHIFT_ACCEPT)
+      *mark = cur = utf8_skip_ascii(cur, end);
+    block = end - cur > 64 ? cur + 64 : end;
+    for (; cur < block; cur++)
+      state = UTF8_SHIFT_STEP(state, *cur);
   }
+  return state;
+}
 
-  if ((v & 0x1000) == 0) {
-    v = v & 0x0F20;
-    if (v == 0 || v == 0x0D20)
-      return 1;
-    if (len < 3 || (cur[2] & 0xC0) != 0x80)
-      return 2;
-    return 3;
+/*
+ * Returns the end of the last complete sequence in the run of complete
+ * sequences at the start of cur to end, which is the cursor of the first
+ * ill-formed sequence.
+ */
+static inline const unsigned char *
+utf8_shift_dfa_cursor(const unsigned char *cur, const unsigned char *end) {
+  const unsigned char *accept = cur;
+  unsigned state = UTF8_SHIFT_ACCEPT;
+
+  for (; cur < end && state != UTF8_SHIFT_REJECT; cur++) {
+    state = UTF8_SHIFT_STEP(state, *cur);
+    accept = state == UTF8_SHIFT_ACCEPT ? cur + 1 : accept;
   }
+  return accept;
+}
 
-  if ((v & 0x0800) == 0) {
-    v = v & 0x0730;
-    if (v == 0 || v > 0x0400)
-      return 1;
-    if (len < 3 || (cur[2] & 0xC0) != 0x80)
-      return 2;
-    if (len < 4 || (cur[3] & 0xC0) != 0x80)
-      return 3;
-    return 4;
+/*
+ * Returns the same result and cursor as utf8_check_scalar.
+ */
+bool
+utf8_check_shift_dfa(const char *src, size_t len, size_t *cursor) {
+  const unsigned char *s = (const unsigned char *)src;
+  const unsigned char *p0, *p1, *p2, *p3, *pos[4], *end[4], *mark[4];
+  unsigned s0, s1, s2, s3, states[4];
+  size_t bound[5], m, i;
+  int live[4], n, j, k;
+
+  bound[0] = 0;
+  bound[4] = len;
+  if (len < UTF8_SHIFT_DFA_SPLIT)
+    bound[1] = bound[2] = bound[3] = len;
+  else {
+    /* Segments start at sequence starts, a misplaced boundary fails its segment */
+    bound[1] = utf8_resync(src, len, len / 4);
+    bound[2] = utf8_resync(src, len, len / 2);
+    bound[3] = utf8_resync(src, len, len / 2 + len / 4);
   }
 
-  return 1;
+  for (k = 0; k < 4; k++) {
+    pos[k] = mark[k] = s + bound[k];
+    end[k] = s + bound[k + 1];
+    states[k] = UTF8_SHIFT_ACCEPT;
+    live[k] = k;
+  }
+
+  /*
+   * Step the live segments together, four, three or two at a time. A
+   * segment that reaches its end leaves the set, the last one is finished
+   * below on its own.
+   */
+  n = len < UTF8_SHIFT_DFA_SPLIT ? 0 : 4;
+  while (n > 1) {
+    m = 64;
+    for (j = 0; j < n; j++) {
+      k = live[j];
+      if (states[k] == UTF8_SHIFT_ACCEPT)
+        mark[k] = pos[k] = utf8_skip_ascii(pos[k], end[k]);
+      if ((size_t)(end[k] - pos[k]) < m)
+        m = end[k] - pos[k];
+    }
+
+    if (m == 0) {
+      for (j = 0, k = 0; j < n; j++) {
+        if (pos[live[j]] != end[live[j]])
+          live[k++] = live[j];
+      }
+      n = k;
+      continue;
+    }
+
+    p0 = pos[live[0]], s0 = states[live[0]];
+    p1 = pos[live[1]], s1 = states[live[1]];
+    if (n == 4) {
+      p2 = pos[live[2]], s2 = states[live[2]];
+      p3 = pos[live[3]], s3 = states[live[3]];
+      for (i = 0; i < m; i++) {
+        s0 = UTF8_SHIFT_STEP(s0, p0[i]);
+        s1 = UTF8_SHIFT_STEP(s1, p1[i]);
+        s2 = UTF8_SHIFT_STEP(s2, p2[i]);
+        s3 = UTF8_SHIFT_STEP(s3, p3[i]);
+      }
+      states[live[2]] = s2;
+      states[live[3]] = s3;
+    } else if (n == 3) {
+      p2 = pos[live[2]], s2 = states[live[2]];
+      for (i = 0; i < m; i++) {
+        s0 = UTF8_SHIFT_STEP(s0, p0[i]);
+        s1 = UTF8_SHIFT_STEP(s1, p1[i]);
+        s2 = UTF8_SHIFT_STEP(s2, p2[i]);
+      }
+      states[live[2]] = s2;
+    } else {
+      for (i = 0; i < m; i++) {
+        s0 = UTF8_SHIFT_STEP(s0, p0[i]);
+        s1 = UTF8_SHIFT_STEP(s1, p1[i]);
+      }
+    }
+    states[live[0]] = s0;
+    states[live[1]] = s1;
+
+    for (j = 0, k = 0; j < n; j++) {
+      pos[live[j]] += m;
+      k |= states[live[j]] == UTF8_SHIFT_REJECT;
+    }
+    if (k)
+      break;
+  }
+
+  /*
+   * Finish the segments in order, the first one that does not end in the
+   * accept state holds the first ill-formed sequence, every segment before
+   * it is a run of complete sequences.
+   */
+  for (k = 0; k < 4; k++) {
+    if (utf8_shift_dfa_run(pos[k], end[k], states[k], &mark[k]) != UTF8_SHIFT_ACCEPT) {
+      if (cursor)
+        *cursor = (const char *)utf8_shift_dfa_cursor(mark[k], end[k]) - src;
+      return false;
+    }
+  }
+
+  if (cursor)
+    *cursor = len;
+  return true;
+}
+
+/*
+ * Calls fn for every maximal subpart of an ill-formed sequence. The input
+ * is cut at sequence boundaries into chunks of 4 * UTF8_SHIFT_DFA_SPLIT
+ * bytes, which are run in four segments by utf8_check_shift_dfa. The rest
+ * of a chunk after an error is run in one stream that keeps the end of the
+ * last complete sequence, the chunks after it are not affected. Returns
+ * the number of subparts.
+ */
+static inline size_t
+utf8_scan_shift_dfa(const char *src, size_t len, utf8_scan_fn fn, void *ctx) {
+  const unsigned char *s = (const unsigned char *)src;
+  size_t off, cur, end, n, count = 0;
+
+  for (off = 0; off < len; off = end) {
+    end = utf8_resync(src, len, off + 4 * UTF8_SHIFT_DFA_SPLIT);
+    if (utf8_check_shift_dfa(src + off, end - off, &cur))
+      continue;
+
+    for (off += cur; off < end; off = cur) {
+      n = utf8_maximal_subpart(src + off, end - off);
+      fn(ctx, off, n);
+      count++;
+      cur = (const char *)utf8_shift_dfa_cursor(s + off + n, s + end) - src;
+    }
+  }
+  return count;
+}
+
+/*
+ * Calls fn for every maximal subpart of an ill-formed sequence. The scalar
+ * decoder keeps no state across sequences, so it goes on right after a
+ * subpart. Returns the number of subparts.
+ */
+static inline size_t
+utf8_scan_scalar(const char *src, size_t len, utf8_scan_fn fn, void *ctx) {
+  size_t off, cur, n, count;
+
+  for (off = 0, count = 0; !utf8_check_scalar(src + off, len - off, &cur); count++) {
+    off += cur;
+    n = utf8_maximal_subpart(src + off, len - off);
+    fn(ctx, off, n);
+    off += n;
+  }
+  return count;
+}
+
+#ifdef UTF8_VALID_X86
+
+/*
+ *    Vector kernels
+ *
+ *    The vector kernels classify every byte by looking up the high and
+ *    low nibble of the preceding byte and the high nibble of the byte
+ *    itself in three 16-entry tables. The bitwise AND of the lookups is
+ *    non-zero if the pair of bytes can not occur in well-formed UTF-8.
+ *    Bytes that must be the third or fourth byte of a sequence are found
+ *    by looking two and three bytes back, the previous block is carried
+ *    over so that sequences may span blocks.
+ *
+ *    A byte is only flagged once the bytes before it can no longer be the
+ *    prefix of a well-formed sequence, so the first flagged byte is either
+ *    the start of the ill-formed sequence or it interrupts a sequence that
+ *    started at most three bytes earlier.
+ *
+ *    Given a callback, a kernel reports every maximal subpart of an
+ *    ill-formed sequence instead of stopping at the first, and goes on in
+ *    the same loop. The flag of a byte depends on it and the three bytes
+ *    before it only, so once the sequences from the end of a subpart have
+ *    been decoded past three bytes, the flags of the block are those of a
+ *    fresh start there, and every error in a block is found from a single
+ *    classification.
+ */
+
+#define UTF8_TOO_SHORT      0x01 /* 11______ 0_______, 11______ 11______ */
+#define UTF8_TOO_LONG       0x02 /* 0_______ 10______ */
+#define UTF8_OVERLONG_3     0x04 /* 11100000 100_____ */
+#define UTF8_TOO_LARGE      0x08 /* 11110100 1001____, 11110100 101_____ */
+#define UTF8_SURROGATE      0x10 /* 11101101 101_____ */
+#define UTF8_OVERLONG_2     0x20 /* 1100000_ 10______ */
+#define UTF8_TOO_LARGE_1000 0x40 /* 11110101 1000____, 11111___ 1000____ */
+#define UTF8_OVERLONG_4     0x40 /* 11110000 1000____ */
+#define UTF8_TWO_CONTS      0x80 /* 10______ 10______ */
+#define UTF8_CARRY          (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+static const unsigned char utf8_byte_1_high[16] = {
+  /* 0_______ ________ */
+  UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+  UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+  /* 10______ ________ */
+  UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+  /* 1100____ ________ */
+  UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+  /* 1101____ ________ */
+  UTF8_TOO_SHORT,
+  /* 1110____ ________ */
+  UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+  /* 1111____ ________ */
+  UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4
+};
+
+static const unsigned char utf8_byte_1_low[16] = {
+  /* ____0000 ________ */
+  UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+  /* ____0001 ________ */
+  UTF8_CARRY | UTF8_OVERLONG_2,
+  /* ____001_ ________ */
+  UTF8_CARRY,
+  UTF8_CARRY,
+  /* ____0100 ________ */
+  UTF8_CARRY | UTF8_TOO_LARGE,
+  /* ____0101 ________ */
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  /* ____011_ ________ */
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  /* ____1___ ________ */
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  /* ____1101 ________ */
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000
+};
+
+static const unsigned char utf8_byte_2_high[16] = {
+  /* ________ 0_______ */
+  UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+  UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+  /* ________ 1000____ */
+  UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 |
+  UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+  /* ________ 1001____ */
+  UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 |
+  UTF8_TOO_LARGE,
+  /* ________ 101_____ */
+  UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE |
+  UTF8_TOO_LARGE,
+  UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE |
+  UTF8_TOO_LARGE,
+  /* ________ 11______ */
+  UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT
+};
+
+/*
+ * A block is incomplete if any of its last three bytes is a lead byte of
+ * a sequence that does not fit in the block. The kernels load the tail of
+ * this table that matches their block size.
+ */
+static const unsigned char utf8_incomplete_max[64] = {
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xEF, 0xDF, 0xBF
+};
+
+/*
+ * Returns the offset of the ill-formed sequence, given the offset of the
+ * first byte flagged by a vector kernel since it resumed at base. A flag
+ * in the zero padding after the end of the input is taken at len.
+ */
+static inline size_t
+utf8_flagged_offset(const char *src, size_t len, size_t base, size_t pos) {
+  const unsigned char *s = (const unsigned char *)src;
+  size_t i;
+
+  if (pos > len)
+    pos = len;
+  for (i = 1; i <= 3 && i <= pos - base; i++) {
+    if ((s[pos - i] & 0xC0) == 0x80)
+      continue;
+    if (utf8_sequence_length(s[pos - i]) > i)
+      return pos - i;
+    break;
+  }
+  return pos;
+}
+
+/*
+ * Reports the ill-formed sequence at pos, and any that follow before the
+ * sequences after it reach three bytes past its end. Returns the sequence
+ * boundary reached, or len.
+ */
+static inline size_t
+utf8_scan_resume(const char *src, size_t len, size_t pos,
+                 utf8_scan_fn fn, void *ctx, size_t *count) {
+  size_t n, end;
+  unsigned char c;
+
+  for (;;) {
+    n = utf8_maximal_subpart(src + pos, len - pos);
+    fn(ctx, pos, n);
+    (*count)++;
+
+    /* A sequence is well-formed if its maximal subpart is all of it */
+    for (pos += n, end = pos + 3; pos < end && pos < len; pos += n) {
+      c = (unsigned char)src[pos];
+      n = c < 0x80 ? 1 : utf8_maximal_subpart(src + pos, len - pos);
+      if (c >= 0x80 && (c < 0xC0 || n != utf8_sequence_length(c)))
+        break;
+    }
+    if (pos >= end || pos >= len)
+      return pos;
+  }
+}
+
+/*
+ * Reports the errors flagged in mask, bit i for the byte at block + i,
+ * with the scan resumed at base. Returns where the scan resumes after the
+ * last of them, the flags from there on are still valid, or len. Flags in
+ * the zero padding after the end of the input are left once it is reached.
+ */
+static inline size_t
+utf8_scan_flags(const char *src, size_t len, size_t block, uint64_t mask, size_t base,
+                utf8_scan_fn fn, void *ctx, size_t *count) {
+  size_t pos;
+
+  while (mask && base < len) {
+    pos = utf8_flagged_offset(src, len, base, block + __builtin_ctzll(mask));
+    base = utf8_scan_resume(src, len, pos, fn, ctx, count);
+    mask = base - block < 64 ? mask & ~(uint64_t)0 << (base - block) : 0;
+  }
+  return base;
+}
+
+#define UTF8_SSE4_PREV(input, prev_input, n) \
+  _mm_alignr_epi8(input, prev_input, 16 - (n))
+
+__attribute__((target("sse4.1")))
+static inline __m128i
+utf8_sse4_errors(__m128i input, __m128i prev_input) {
+  const __m128i nibble = _mm_set1_epi8(0x0F);
+  __m128i prev1, prev2, prev3, sc, must23;
+
+  prev1 = UTF8_SSE4_PREV(input, prev_input, 1);
+  sc = _mm_and_si128(
+    _mm_and_si128(
+      _mm_shuffle_epi8(
+        _mm_loadu_si128((const __m128i *)utf8_byte_1_high),
+        _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+      _mm_shuffle_epi8(
+        _mm_loadu_si128((const __m128i *)utf8_byte_1_low),
+        _mm_and_si128(prev1, nibble))),
+    _mm_shuffle_epi8(
+      _mm_loadu_si128((const __m128i *)utf8_byte_2_high),
+      _mm_and_si128(_mm_srli_epi16(input, 4), nibble)));
+
+  prev2 = UTF8_SSE4_PREV(input, prev_input, 2);
+  prev3 = UTF8_SSE4_PREV(input, prev_input, 3);
+  must23 = _mm_or_si128(
+    _mm_subs_epu8(prev2, _mm_set1_epi8((char)(0xE0 - 0x80))),
+    _mm_subs_epu8(prev3, _mm_set1_epi8((char)(0xF0 - 0x80))));
+  must23 = _mm_and_si128(must23, _mm_set1_epi8((char)0x80));
+  return _mm_xor_si128(must23, sc);
+}
+
+/*
+ * Returns true if the 64 bytes at cur are ASCII, the four loads are
+ * combined and tested once.
+ */
+__attribute__((target("sse4.1")))
+static inline bool
+utf8_sse4_ascii64(const unsigned char *cur) {
+  __m128i a, b;
+
+  a = _mm_or_si128(_mm_loadu_si128((const __m128i *)cur),
+                   _mm_loadu_si128((const __m128i *)(cur + 16)));
+  b = _mm_or_si128(_mm_loadu_si128((const __m128i *)(cur + 32)),
+                   _mm_loadu_si128((const __m128i *)(cur + 48)));
+  return _mm_movemask_epi8(_mm_or_si128(a, b)) == 0;
+}
+
+__attribute__((target("sse4.1")))
+static inline size_t
+utf8_scan_sse4(const char *src, size_t len, size_t *cursor, utf8_scan_fn fn, void *ctx) {
+  const unsigned char *cur = (const unsigned char *)src;
+  const unsigned char *end = cur + len;
+  const __m128i max = _mm_loadu_si128((const __m128i *)(utf8_incomplete_max + 48));
+  const __m128i zero = _mm_setzero_si128();
+  __m128i input, prev_input, errors, incomplete;
+  unsigned char buf[16];
+  uint16_t mask;
+  size_t pos, base = 0, count = 0;
+  bool last;
+
+  prev_input = zero;
+  incomplete = zero;
+  for (;;) {
+    last = end - cur < 16;
+    if (!last)
+      input = _mm_loadu_si128((const __m128i *)cur);
+    else {
+      if (cur == end && _mm_testz_si128(incomplete, incomplete))
+        break;
+      memset(buf, 0, 16);
+      utf8_copy_short(buf, cur, end - cur);
+      input = _mm_loadu_si128((const __m128i *)buf);
+    }
+
+    if (_mm_movemask_epi8(input) != 0 || !_mm_testz_si128(incomplete, incomplete)) {
+      errors = utf8_sse4_errors(input, prev_input);
+      if (!_mm_testz_si128(errors, errors)) {
+        mask = (uint16_t)~_mm_movemask_epi8(_mm_cmpeq_epi8(errors, zero));
+        pos = (const char *)cur - src;
+        if (!fn) {
+          if (cursor)
+            *cursor = utf8_flagged_offset(src, len, base, pos + __builtin_ctz(mask));
+          return 1;
+        }
+        base = utf8_scan_flags(src, len, pos, mask, base, fn, ctx, &count);
+        if (base >= len)
+          break;
+        if (base >= pos + 16) {
+          /* Past the block, resume as at the start of the input */
+          cur = (const unsigned char *)src + base;
+          prev_input = zero;
+          incomplete = zero;
+          continue;
+        }
+      }
+      incomplete = _mm_subs_epu8(input, max);
+    }
+    else if (!last) {
+      /* The run of ASCII after an ASCII block is checked 64 bytes at a time */
+      while (end - cur >= 16 + 64 && utf8_sse4_ascii64(cur + 16))
+        cur += 64;
+      input = _mm_loadu_si128((const __m128i *)cur);
+    }
+
+    if (last)
+      break;
+    prev_input = input;
+    cur += 16;
+  }
+
+  if (cursor)
+    *cursor = len;
+  return count;
+}
+
+__attribute__((target("sse4.1")))
+bool
+utf8_check_sse4(const char *src, size_t len, size_t *cursor) {
+  return utf8_scan_sse4(src, len, cursor, NULL, NULL) == 0;
+}
+
+#define UTF8_AVX2_PREV(input, prev_input, n) \
+  _mm256_alignr_epi8(input, _mm256_permute2x128_si256(prev_input, input, 0x21), 16 - (n))
+
+/*
+ * Classifies the bytes of input given the bytes one, two and three
+ * positions before each of them, a byte is non-zero where an error ends.
+ */
+__attribute__((target("avx2")))
+static inline __m256i
+utf8_avx2_classify(__m256i input, __m256i prev1, __m256i prev2, __m256i prev3) {
+  const __m256i nibble = _mm256_set1_epi8(0x0F);
+  __m256i sc, must23;
+
+  sc = _mm256_and_si256(
+    _mm256_and_si256(
+      _mm256_shuffle_epi8(
+        _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)utf8_byte_1_high)),
+        _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+      _mm256_shuffle_epi8(
+        _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)utf8_byte_1_low)),
+        _mm256_and_si256(prev1, nibble))),
+    _mm256_shuffle_epi8(
+      _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)utf8_byte_2_high)),
+      _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble)));
+
+  must23 = _mm256_or_si256(
+    _mm256_subs_epu8(prev2, _mm256_set1_epi8((char)(0xE0 - 0x80))),
+    _mm256_subs_epu8(prev3, _mm256_set1_epi8((char)(0xF0 - 0x80))));
+  must23 = _mm256_and_si256(must23, _mm256_set1_epi8((char)0x80));
+  return _mm256_xor_si256(must23, sc);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+utf8_avx2_errors(__m256i input, __m256i prev_input) {
+  return utf8_avx2_classify(input,
+    UTF8_AVX2_PREV(input, prev_input, 1),
+    UTF8_AVX2_PREV(input, prev_input, 2),
+    UTF8_AVX2_PREV(input, prev_input, 3));
+}
+
+/*
+ * Returns true if the 64 bytes at cur are ASCII, the two loads are
+ * combined and tested once.
+ */
+__attribute__((target("avx2")))
+static inline bool
+utf8_avx2_ascii64(const unsigned char *cur) {
+  return _mm256_movemask_epi8(_mm256_or_si256(
+    _mm256_loadu_si256((const __m256i *)cur),
+    _mm256_loadu_si256((const __m256i *)(cur + 32)))) == 0;
+}
+
+__attribute__((target("avx2")))
+static inline size_t
+utf8_scan_avx2(const char *src, size_t len, size_t *cursor, utf8_scan_fn fn, void *ctx) {
+  const unsigned char *cur = (const unsigned char *)src;
+  const unsigned char *end = cur + len;
+  const __m256i max = _mm256_loadu_si256((const __m256i *)(utf8_incomplete_max + 32));
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i input, prev_input, errors, incomplete;
+  unsigned char buf[32];
+  uint32_t mask;
+  size_t pos, base = 0, count = 0;
+  bool last;
+
+  prev_input = zero;
+  incomplete = zero;
+  for (;;) {
+    last = end - cur < 32;
+    if (!last)
+      input = _mm256_loadu_si256((const __m256i *)cur);
+    else {
+      if (cur == end && _mm256_testz_si256(incomplete, incomplete))
+        break;
+      memset(buf, 0, 32);
+      if (end - cur >= 16) {
+        memcpy(buf, cur, 16);
+        utf8_copy_short(buf + 16, cur + 16, end - cur - 16);
+      }
+      else
+        utf8_copy_short(buf, cur, end - cur);
+      input = _mm256_loadu_si256((const __m256i *)buf);
+    }
+
+    if (_mm256_movemask_epi8(input) != 0 || !_mm256_testz_si256(incomplete, incomplete)) {
+      errors = utf8_avx2_errors(input, prev_input);
+      if (!_mm256_testz_si256(errors, errors)) {
+        mask = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(errors, zero));
+        pos = (const char *)cur - src;
+        if (!fn) {
+          if (cursor)
+            *cursor = utf8_flagged_offset(src, len, base, pos + __builtin_ctz(mask));
+          return 1;
+        }
+        base = utf8_scan_flags(src, len, pos, mask, base, fn, ctx, &count);
+        if (base >= len)
+          break;
+        if (base >= pos + 32) {
+          /* Past the block, resume as at the start of the input */
+          cur = (const unsigned char *)src + base;
+          prev_input = zero;
+          incomplete = zero;
+          continue;
+        }
+      }
+      incomplete = _mm256_subs_epu8(input, max);
+    }
+    else if (!last) {
+      /* The run of ASCII after an ASCII block is checked 64 bytes at a time */
+      while (end - cur >= 32 + 64 && utf8_avx2_ascii64(cur + 32))
+        cur += 64;
+      input = _mm256_loadu_si256((const __m256i *)cur);
+    }
+
+    if (last)
+      break;
+    prev_input = input;
+    cur += 32;
+  }
+
+  if (cursor)
+    *cursor = len;
+  return count;
+}
+
+__attribute__((target("avx2")))
+bool
+utf8_check_avx2(const char *src, size_t len, size_t *cursor) {
+  return utf8_scan_avx2(src, len, cursor, NULL, NULL) == 0;
+}
+
+static const unsigned char utf8_iota[64] = {
+   0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15,
+  16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31,
+  32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46, 47,
+  48, 49, 50, 51, 52, 53, 54, 55, 56, 57, 58, 59, 60, 61, 62, 63
+};
+
+#define UTF8_AVX512_PREV(input, prev_input, iota, n) \
+  _mm512_permutex2var_epi8(prev_input, _mm512_add_epi8(iota, _mm512_set1_epi8(64 - (n))), input)
+
+/*
+ * The nibble lookups use vpermb, indices in [0, 15] only select from the
+ * low 128 bits of the table. The zero-masking form with every lane
+ * enabled is the same instruction, and keeps GCC from warning about the
+ * undefined merge source of the unmasked form.
+ */
+#define UTF8_AVX512_LOOKUP(table, idx) \
+  _mm512_maskz_permutexvar_epi8(~(__mmask64)0, idx, \
+    _mm512_castsi128_si512(_mm_loadu_si128((const __m128i *)(table))))
+
+/*
+ * Returns a mask of the flagged bytes.
+ */
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+static inline uint64_t
+utf8_avx512_errors(__m512i input, __m512i prev_input) {
+  const __m512i nibble = _mm512_set1_epi8(0x0F);
+  const __m512i iota = _mm512_loadu_si512((const void *)utf8_iota);
+  __m512i prev1, prev2, prev3, sc;
+  __mmask64 must23;
+
+  prev1 = UTF8_AVX512_PREV(input, prev_input, iota, 1);
+  sc = _mm512_and_si512(
+    _mm512_and_si512(
+      UTF8_AVX512_LOOKUP(utf8_byte_1_high, _mm512_and_si512(_mm512_srli_epi16(prev1, 4), nibble)),
+      UTF8_AVX512_LOOKUP(utf8_byte_1_low, _mm512_and_si512(prev1, nibble))),
+    UTF8_AVX512_LOOKUP(utf8_byte_2_high, _mm512_and_si512(_mm512_srli_epi16(input, 4), nibble)));
+
+  prev2 = UTF8_AVX512_PREV(input, prev_input, iota, 2);
+  prev3 = UTF8_AVX512_PREV(input, prev_input, iota, 3);
+  must23 = _mm512_cmpge_epu8_mask(prev2, _mm512_set1_epi8((char)0xE0))
+         | _mm512_cmpge_epu8_mask(prev3, _mm512_set1_epi8((char)0xF0));
+  sc = _mm512_xor_si512(sc, _mm512_maskz_mov_epi8(must23, _mm512_set1_epi8((char)0x80)));
+  return _mm512_test_epi8_mask(sc, sc);
+}
+
+/*
+ * The tail of the input is read with a masked load, which zero fills the
+ * block without touching memory past the end of the input.
+ */
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+static inline size_t
+utf8_scan_avx512(const char *src, size_t len, size_t *cursor, utf8_scan_fn fn, void *ctx) {
+  const unsigned char *cur = (const unsigned char *)src;
+  const unsigned char *end = cur + len;
+  const __m512i max = _mm512_loadu_si512((const void *)utf8_incomplete_max);
+  __m512i input, prev_input;
+  uint64_t errors, incomplete;
+  size_t pos, base = 0, count = 0;
+  bool last;
+
+  prev_input = _mm512_setzero_si512();
+  incomplete = 0;
+  for (;;) {
+    last = end - cur < 64;
+    if (!last)
+      input = _mm512_loadu_si512((const void *)cur);
+    else {
+      if (cur == end && !incomplete)
+        break;
+      input = _mm512_maskz_loadu_epi8(((uint64_t)1 << (end - cur)) - 1, cur);
+    }
+
+    if (_mm512_movepi8_mask(input) != 0 || incomplete) {
+      errors = utf8_avx512_errors(input, prev_input);
+      if (errors) {
+        pos = (const char *)cur - src;
+        if (!fn) {
+          if (cursor)
+            *cursor = utf8_flagged_offset(src, len, base, pos + __builtin_ctzll(errors));
+          return 1;
+        }
+        base = utf8_scan_flags(src, len, pos, errors, base, fn, ctx, &count);
+        if (base >= len)
+          break;
+        if (base >= pos + 64) {
+          /* Past the block, resume as at the start of the input */
+          cur = (const unsigned char *)src + base;
+          prev_input = _mm512_setzero_si512();
+          incomplete = 0;
+          continue;
+        }
+      }
+      incomplete = _mm512_cmpgt_epu8_mask(input, max);
+    }
+
+    if (last)
+      break;
+    prev_input = input;
+    cur += 64;
+  }
+
+  if (cursor)
+    *cursor = len;
+  return count;
+}
+
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+bool
+utf8_check_avx512(const char *src, size_t len, size_t *cursor) {
+  return utf8_scan_avx512(src, len, cursor, NULL, NULL) == 0;
+}
+
+/*
+ *    Multi-buffer validation
+ *
+ *    The AVX2 classification only moves bytes within a 128-bit lane when
+ *    the previous bytes are taken with an in-lane alignment, so each lane
+ *    can carry a string of its own. Four short strings are validated at a
+ *    time in the lanes of two vectors, sixteen bytes of each per step. The
+ *    zero block after the end of a string catches a truncated sequence.
+ */
+
+/* Shuffle that places n bytes, loaded by utf8_load_partial, and zeroes the rest */
+static const unsigned char utf8_partial_shuffle[16][16] = {
+  { 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+  { 0x00, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+  { 0x00, 0x01, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+  { 0x00, 0x01, 0x02, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+  { 0x00, 0x01, 0x02, 0x03, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+  { 0x00, 0x01, 0x02, 0x03, 0x07, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+  { 0x00, 0x01, 0x02, 0x03, 0x06, 0x07, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+  { 0x00, 0x01, 0x02, 0x03, 0x05, 0x06, 0x07, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+  { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+  { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x0F, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+  { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x0E, 0x0F, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+  { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x0D, 0x0E, 0x0F, 0x80, 0x80, 0x80, 0x80, 0x80 },
+  { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x0C, 0x0D, 0x0E, 0x0F, 0x80, 0x80, 0x80, 0x80 },
+  { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0x80, 0x80, 0x80 },
+  { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0x80, 0x80 },
+  { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0x80 }
+};
+
+/*
+ * Loads the n < 16 bytes at src into a vector and zeroes the rest, without
+ * reading past src + n. Two overlapping loads of a fixed size are merged
+ * with a shuffle.
+ */
+__attribute__((target("avx2")))
+static inline __m128i
+utf8_load_partial(const unsigned char *src, size_t n) {
+  uint64_t lo, hi;
+  uint32_t w0, w1;
+  __m128i v;
+
+  if (n >= 8) {
+    memcpy(&lo, src, 8);
+    memcpy(&hi, src + n - 8, 8);
+    v = _mm_set_epi64x((long long)hi, (long long)lo);
+  }
+  else if (n >= 4) {
+    memcpy(&w0, src, 4);
+    memcpy(&w1, src + n - 4, 4);
+    v = _mm_cvtsi64_si128((long long)((uint64_t)w1 << 32 | w0));
+  }
+  else if (n > 0)
+    v = _mm_cvtsi32_si128(src[0] | src[n >> 1] << 8 | src[n - 1] << 16);
+  else
+    return _mm_setzero_si128();
+
+  return _mm_shuffle_epi8(v, _mm_loadu_si128((const __m128i *)utf8_partial_shuffle[n]));
+}
+
+/*
+ * Loads the sixteen bytes at offset off of a string, zero padded.
+ */
+__attribute__((target("avx2")))
+static inline __m128i
+utf8_load_lane(const char *src, size_t len, size_t off) {
+  if (off >= len)
+    return _mm_setzero_si128();
+  if (len - off >= 16)
+    return _mm_loadu_si128((const __m128i *)(src + off));
+  return utf8_load_partial((const unsigned char *)src + off, len - off);
+}
+
+#define UTF8_AVX2_LANE_PREV(input, prev_input, n) \
+  _mm256_alignr_epi8(input, prev_input, 16 - (n))
+
+/*
+ * Validates up to four strings, string i in lane i of two vectors if bit i
+ * of used is set. Returns a mask with bit i set if string i is well-formed,
+ * or not used.
+ */
+__attribute__((target("avx2")))
+static inline unsigned
+utf8_multi_avx2(const char *const *strs, const size_t *sizes, unsigned used) {
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i a, b, prev_a, prev_b, errors_a, errors_b;
+  const char *ptrs[4];
+  size_t lens[4], off, max, i;
+  unsigned ma, mb;
+
+  for (i = 0, max = 0; i < 4; i++) {
+    ptrs[i] = (used >> i & 1) ? strs[i] : "";
+    lens[i] = (used >> i & 1) ? sizes[i] : 0;
+    if (lens[i] > max)
+      max = lens[i];
+  }
+
+  prev_a = prev_b = errors_a = errors_b = zero;
+  for (off = 0; off <= max; off += 16) {
+    a = _mm256_inserti128_si256(_mm256_castsi128_si256(
+          utf8_load_lane(ptrs[0], lens[0], off)), utf8_load_lane(ptrs[1], lens[1], off), 1);
+    b = _mm256_inserti128_si256(_mm256_castsi128_si256(
+          utf8_load_lane(ptrs[2], lens[2], off)), utf8_load_lane(ptrs[3], lens[3], off), 1);
+
+    /* ASCII after ASCII can't end an error */
+    if (_mm256_movemask_epi8(_mm256_or_si256(
+          _mm256_or_si256(a, b), _mm256_or_si256(prev_a, prev_b))) != 0) {
+      errors_a = _mm256_or_si256(errors_a, utf8_avx2_classify(a,
+        UTF8_AVX2_LANE_PREV(a, prev_a, 1),
+        UTF8_AVX2_LANE_PREV(a, prev_a, 2),
+        UTF8_AVX2_LANE_PREV(a, prev_a, 3)));
+      errors_b = _mm256_or_si256(errors_b, utf8_avx2_classify(b,
+        UTF8_AVX2_LANE_PREV(b, prev_b, 1),
+        UTF8_AVX2_LANE_PREV(b, prev_b, 2),
+        UTF8_AVX2_LANE_PREV(b, prev_b, 3)));
+    }
+    prev_a = a;
+    prev_b = b;
+  }
+
+  ma = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(errors_a, zero));
+  mb = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(errors_b, zero));
+  return ((ma & 0xFFFF) == 0xFFFF)
+       | ((ma >> 16) == 0xFFFF) << 1
+       | ((mb & 0xFFFF) == 0xFFFF) << 2
+       | ((mb >> 16) == 0xFFFF) << 3;
+}
+
+#endif
+
+/*
+ *    Kernel dispatch
+ *
+ *    utf8_check calls the kernel through a function pointer. The pointer
+ *    starts out at a resolver, which selects the best kernel supported by
+ *    the CPU on the first call and replaces itself, so every later call
+ *    costs one indirect call. utf8_kernel_select forces a kernel, which is
+ *    useful to pin the behavior in benchmarks and tests.
+ */
+
+typedef enum {
+  UTF8_KERNEL_AUTO = 0,
+  UTF8_KERNEL_SCALAR,
+  UTF8_KERNEL_SSE4,
+  UTF8_KERNEL_AVX2,
+  UTF8_KERNEL_AVX512,
+  UTF8_KERNEL_DFA,
+  UTF8_KERNEL_SHIFT_DFA
+} utf8_kernel_t;
+
+#define UTF8_KERNEL_COUNT (UTF8_KERNEL_SHIFT_DFA + 1)
+
+/*
+ * Kernel selected by UTF8_KERNEL_AUTO when the CPU supports no vector
+ * kernel, and always with UTF8_VALID_NO_SIMD. The shift DFA unless
+ * UTF8_VALID_DFA is defined, which falls back to the table-driven DFA.
+ */
+#ifdef UTF8_VALID_DFA
+#define UTF8_KERNEL_FALLBACK UTF8_KERNEL_DFA
+#else
+#define UTF8_KERNEL_FALLBACK UTF8_KERNEL_SHIFT_DFA
+#endif
+
+typedef bool (*utf8_check_fn)(const char *src, size_t len, size_t *cursor);
+
+#ifdef __GNUC__
+#define UTF8_ATOMIC_LOAD(p)     __atomic_load_n(p, __ATOMIC_RELAXED)
+#define UTF8_ATOMIC_STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELAXED)
+#else
+#define UTF8_ATOMIC_LOAD(p)     (*(p))
+#define UTF8_ATOMIC_STORE(p, v) (*(p) = (v))
+#endif
+
+#ifdef __GNUC__
+#define UTF8_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define UTF8_PREFETCH(p) ((void)(p))
+#endif
+
+static bool utf8_check_resolve(const char *src, size_t len, size_t *cursor);
+
+static utf8_check_fn utf8_check_kernel = utf8_check_resolve;
+static utf8_kernel_t utf8_check_kernel_id = UTF8_KERNEL_AUTO;
+
+const char *
+utf8_kernel_name(utf8_kernel_t kernel) {
+  switch (kernel) {
+    case UTF8_KERNEL_AUTO:   return "auto";
+    case UTF8_KERNEL_SCALAR: return "scalar";
+    case UTF8_KERNEL_SSE4:   return "sse4";
+    case UTF8_KERNEL_AVX2:   return "avx2";
+    case UTF8_KERNEL_AVX512: return "avx512";
+    case UTF8_KERNEL_DFA:    return "dfa";
+    case UTF8_KERNEL_SHIFT_DFA: return "shiftdfa";
+  }
+  return "unknown";
+}
+
+bool
+utf8_kernel_supported(utf8_kernel_t kernel) {
+  switch (kernel) {
+    case UTF8_KERNEL_AUTO:
+    case UTF8_KERNEL_SCALAR:
+    case UTF8_KERNEL_DFA:
+    case UTF8_KERNEL_SHIFT_DFA:
+      return true;
+#ifdef UTF8_VALID_X86
+    case UTF8_KERNEL_SSE4:
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("sse4.1");
+    case UTF8_KERNEL_AVX2:
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("avx2");
+    case UTF8_KERNEL_AVX512:
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("avx512bw")
+          && __builtin_cpu_supports("avx512vbmi");
+#endif
+    default:
+      return false;
+  }
+}
+
+static inline utf8_check_fn
+utf8_kernel_function(utf8_kernel_t kernel) {
+  switch (kernel) {
+    case UTF8_KERNEL_DFA:    return utf8_check_dfa;
+    case UTF8_KERNEL_SHIFT_DFA: return utf8_check_shift_dfa;
+#ifdef UTF8_VALID_X86
+    case UTF8_KERNEL_SSE4:   return utf8_check_sse4;
+    case UTF8_KERNEL_AVX2:   return utf8_check_avx2;
+    case UTF8_KERNEL_AVX512: return utf8_check_avx512;
+#endif
+    default:                 return utf8_check_scalar;
+  }
+}
+
+/*
+ * Selects the given kernel for utf8_check, UTF8_KERNEL_AUTO selects the
+ * best kernel supported by the CPU. Returns false, and keeps the current
+ * selection, if the kernel is not supported.
+ */
+bool
+utf8_kernel_select(utf8_kernel_t kernel) {
+  int k;
+
+  if (!utf8_kernel_supported(kernel))
+    return false;
+
+  if (kernel == UTF8_KERNEL_AUTO) {
+    for (k = UTF8_KERNEL_AVX512; k > UTF8_KERNEL_SCALAR; k--) {
+      if (utf8_kernel_supported((utf8_kernel_t)k))
+        break;
+    }
+    kernel = k > UTF8_KERNEL_SCALAR ? (utf8_kernel_t)k : UTF8_KERNEL_FALLBACK;
+  }
+
+  UTF8_ATOMIC_STORE(&utf8_check_kernel_id, kernel);
+  UTF8_ATOMIC_STORE(&utf8_check_kernel, utf8_kernel_function(kernel));
+  return true;
+}
+
+/*
+ * Returns the kernel used by utf8_check.
+ */
+utf8_kernel_t
+utf8_kernel(void) {
+  if (UTF8_ATOMIC_LOAD(&utf8_check_kernel_id) == UTF8_KERNEL_AUTO)
+    utf8_kernel_select(UTF8_KERNEL_AUTO);
+  return UTF8_ATOMIC_LOAD(&utf8_check_kernel_id);
+}
+
+static bool
+utf8_check_resolve(const char *src, size_t len, size_t *cursor) {
+  utf8_kernel_select(UTF8_KERNEL_AUTO);
+  return UTF8_ATOMIC_LOAD(&utf8_check_kernel)(src, len, cursor);
+}
+
+/*
+ * Short strings are mostly ASCII, such as header values and keys, and are
+ * answered without calling a kernel.
+ */
+bool
+utf8_check(const char *src, size_t len, size_t *cursor) {
+  if (len < UTF8_VALID_SHORT && utf8_ascii_short((const unsigned char *)src, len)) {
+    if (cursor)
+      *cursor = len;
+    return true;
+  }
+  return UTF8_ATOMIC_LOAD(&utf8_check_kernel)(src, len, cursor);
+}
+
+bool
+utf8_valid(const char *src, size_t len) {
+  return utf8_check(src, len, NULL);
+}
+
+/* Strings of at least this length are not validated in vector lanes */
+#ifndef UTF8_VALID_MULTI_MAX
+#define UTF8_VALID_MULTI_MAX 64
+#endif
+
+/* The same with the AVX-512 kernel, whose masked load wins past one lane step */
+#ifndef UTF8_VALID_MULTI_MAX_AVX512
+#define UTF8_VALID_MULTI_MAX_AVX512 17
+#endif
+
+/*
+ * Returns the length from which strings are no longer validated in the
+ * lanes of the multi-buffer engine, or 0 if the selected kernel does not
+ * use them. The lanes need AVX2, and with the AVX-512 kernel they are only
+ * faster for strings that fit in one 16-byte step.
+ */
+static inline size_t
+utf8_valid_lanes(void) {
+  switch (utf8_kernel()) {
+    case UTF8_KERNEL_AVX2:
+      return UTF8_VALID_MULTI_MAX;
+    case UTF8_KERNEL_AVX512:
+      return utf8_kernel_supported(UTF8_KERNEL_AVX2) ? UTF8_VALID_MULTI_MAX_AVX512 : 0;
+    default:
+      return 0;
+  }
+}
+
+/*
+ * Validates n <= 4 strings, returns a mask with bit i set if string i is
+ * well-formed. Short ASCII strings are answered by a probe, other short
+ * strings shorter than lanes share the lanes of the multi-buffer engine
+ * and the rest are passed to check.
+ */
+static inline unsigned
+utf8_valid_group(const char *const *ptrs, const size_t *lens, size_t n,
+                 utf8_check_fn check, size_t lanes) {
+  unsigned mask = 0, used = 0;
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    if (lens[i] < UTF8_VALID_SHORT
+        && utf8_ascii_short((const unsigned char *)ptrs[i], lens[i]))
+      mask |= 1u << i;
+    else if (lens[i] < lanes)
+      used |= 1u << i;
+    else if (check(ptrs[i], lens[i], NULL))
+      mask |= 1u << i;
+  }
+
+#ifdef UTF8_VALID_X86
+  if (used)
+    mask |= utf8_multi_avx2(ptrs, lens, used) & used;
+#endif
+  return mask;
+}
+
+/*
+ * Validates n <= 32 independent strings, at most the first 32 are read.
+ * Returns a mask with bit i set if the lens[i] bytes at ptrs[i] are
+ * well-formed. With the AVX2 kernel selected, strings shorter than
+ * UTF8_VALID_MULTI_MAX are validated four at a time, one string in each
+ * 128-bit lane. With the AVX-512 kernel so are strings shorter than
+ * UTF8_VALID_MULTI_MAX_AVX512, longer ones are faster with its masked
+ * load.
+ */
+uint32_t
+utf8_valid_multi(const char *const *ptrs, const size_t *lens, size_t n) {
+  utf8_check_fn check;
+  uint32_t mask = 0;
+  size_t i, lanes;
+
+  if (n > 32)
+    n = 32;
+
+  lanes = utf8_valid_lanes();
+  check = UTF8_ATOMIC_LOAD(&utf8_check_kernel);
+
+  for (i = 0; i < n; i += 4)
+    mask |= (uint32_t)utf8_valid_group(ptrs + i, lens + i, n - i < 4 ? n - i : 4,
+                                       check, lanes) << i;
+  return mask;
+}
+
+/* Number of strings ahead of the current ones that utf8_valid_batch prefetches */
+#ifndef UTF8_VALID_PREFETCH
+#define UTF8_VALID_PREFETCH 8
+#endif
+
+#ifdef UTF8_VALID_X86
+/*
+ * Validates the n <= 4 strings queued by utf8_valid_batch in the lanes of
+ * the multi-buffer engine, stores their results and returns the number of
+ * well-formed strings.
+ */
+static inline size_t
+utf8_valid_flush(const char *const *ptrs, const size_t *lens, const size_t *index,
+                 size_t n, uint8_t *results) {
+  unsigned mask;
+  size_t i, valid;
+
+  mask = utf8_multi_avx2(ptrs, lens, (1u << n) - 1);
+  for (i = 0, valid = 0; i < n; i++) {
+    if (results)
+      results[index[i]] = mask >> i & 1;
+    valid += mask >> i & 1;
+  }
+  return valid;
+}
+#endif
+
+/*
+ * Validates n independent strings, results[i] is set to 1 if the lens[i]
+ * bytes at ptrs[i] are well-formed and 0 otherwise, results may be NULL.
+ * The kernel is resolved once for the whole batch and the strings ahead
+ * are prefetched. Short ASCII strings are answered by a probe, with the
+ * AVX2 or AVX-512 kernel other short strings are queued and validated
+ * four at a time as in utf8_valid_multi. Returns the number of well-formed strings.
+ */
+size_t
+utf8_valid_batch(const char *const *ptrs, const size_t *lens, size_t n, uint8_t *results) {
+  utf8_check_fn check;
+  size_t i, valid;
+  bool ok;
+#ifdef UTF8_VALID_X86
+  const char *queue[4];
+  size_t qlens[4], qindex[4], nqueue = 0;
+  size_t lanes = utf8_valid_lanes();
+#else
+  utf8_kernel();
+#endif
+
+  check = UTF8_ATOMIC_LOAD(&utf8_check_kernel);
+
+  for (i = 0; i < n && i < UTF8_VALID_PREFETCH; i++)
+    UTF8_PREFETCH(ptrs[i]);
+
+  for (i = 0, valid = 0; i < n; i++) {
+    if (i + UTF8_VALID_PREFETCH < n)
+      UTF8_PREFETCH(ptrs[i + UTF8_VALID_PREFETCH]);
+
+    if (lens[i] < UTF8_VALID_SHORT
+        && utf8_ascii_short((const unsigned char *)ptrs[i], lens[i]))
+      ok = true;
+#ifdef UTF8_VALID_X86
+    else if (lens[i] < lanes) {
+      queue[nqueue] = ptrs[i];
+      qlens[nqueue] = lens[i];
+      qindex[nqueue] = i;
+      if (++nqueue == 4) {
+        valid += utf8_valid_flush(queue, qlens, qindex, nqueue, results);
+        nqueue = 0;
+      }
+      continue;
+    }
+#endif
+    else
+      ok = check(ptrs[i], lens[i], NULL);
+
+    if (results)
+      results[i] = ok;
+    valid += ok;
+  }
+
+#ifdef UTF8_VALID_X86
+  if (nqueue)
+    valid += utf8_valid_flush(queue, qlens, qindex, nqueue, results);
+#endif
+  return valid;
+}
+
+size_t
+utf8_maximal_subpart(const char *src, size_t len) {
+  const unsigned char *cur = (const unsigned char *)src;
+  uint32_t v;
+
+  if (len < 2)
+    return len;
+
+  v = (cur[0] << 8) | cur[1];
+  if ((v & 0xC0C0) != 0xC080)
+    return 1;
+
+  if ((v & 0x2000) == 0) {
+    v = v & 0x1E00;
+    if (v == 0)
+      return 1;
+    return 2;
+  }
+
+  if ((v & 0x1000) == 0) {
+    v = v & 0x0F20;
+    if (v == 0 || v == 0x0D20)
+      return 1;
+    if (len < 3 || (cur[2] & 0xC0) != 0x80)
+      return 2;
+    return 3;
+  }
+
+  if ((v & 0x0800) == 0) {
+    v = v & 0x0730;
+    if (v == 0 || v > 0x0400)
+      return 1;
+    if (len < 3 || (cur[2] & 0xC0) != 0x80)
+      return 2;
+    if (len < 4 || (cur[3] & 0xC0) != 0x80)
+      return 3;
+    return 4;
+  }
+
+  return 1;
+}
+
+/*
+ * Returns true if the given 1-3 bytes are a proper prefix of a well-formed
+ * sequence, that is, the sequence is truncated rather than ill-formed.
+ */
+static inline bool
+utf8_incomplete(const unsigned char *src, size_t len) {
+  if (len == 0 || src[0] < 0xC2 || src[0] > 0xF4)
+    return false;
+  if (len >= utf8_sequence_length(src[0]))
+    return false;
+  return utf8_maximal_subpart((const char *)src, len) == len;
+}
+
+/*
+ * Returns a position at or at most three bytes before pos that is not a
+ * continuation byte, input split there can be validated piecewise with the
+ * same result as a whole. If the three bytes before pos are continuation
+ * bytes as well the byte at pos can not be well-formed and pos is returned.
+ */
+size_t
+utf8_resync(const char *src, size_t len, size_t pos) {
+  size_t i;
+
+  if (pos >= len)
+    return len;
+
+  for (i = 0; i <= 3 && i <= pos; i++) {
+    if ((src[pos - i] & 0xC0) != 0x80)
+      return pos - i;
+  }
+  return pos;
+}
+
+typedef enum {
+  UTF8_OK = 0,
+  UTF8_INCOMPLETE,
+  UTF8_INVALID
+} utf8_status_t;
+
+/*
+ * Validates like utf8_check, but tells a sequence that is truncated by the
+ * end of the input apart from an ill-formed one. On UTF8_INCOMPLETE the
+ * cursor is the offset of the truncated sequence, the remaining 1-3 bytes
+ * are well-formed so far and need more input.
+ */
+utf8_status_t
+utf8_check_status(const char *src, size_t len, size_t *cursor) {
+  size_t cur;
+
+  if (utf8_check(src, len, &cur)) {
+    if (cursor)
+      *cursor = len;
+    return UTF8_OK;
+  }
+
+  if (cursor)
+    *cursor = cur;
+
+  if (len - cur <= 3 && utf8_incomplete((const unsigned char *)src + cur, len - cur))
+    return UTF8_INCOMPLETE;
+  return UTF8_INVALID;
+}
+
+/*
+ *    Streaming validation
+ *
+ *    Validates input that arrives in chunks, sequences may be split
+ *    across chunks. At most three bytes of a truncated sequence are kept
+ *    between calls, every other byte is validated exactly once.
+ *
+ *    While the input is well-formed, cursor is the number of bytes that
+ *    are known to be well-formed. Once an ill-formed sequence is found,
+ *    cursor is its offset from the start of the stream and every later
+ *    call returns false.
+ */
+
+typedef struct {
+  size_t offset;
+  size_t cursor;
+  unsigned char pending[4];
+  unsigned char npending;
+  bool failed;
+} utf8_stream_t;
+
+void
+utf8_stream_init(utf8_stream_t *s) {
+  memset(s, 0, sizeof(*s));
+}
+
+static inline bool
+utf8_stream_fail(utf8_stream_t *s, size_t cursor) {
+  s->failed = true;
+  s->cursor = cursor;
+  return false;
+}
+
+bool
+utf8_stream_update(utf8_stream_t *s, const char *src, size_t len) {
+  size_t need, n, cur;
+
+  if (s->failed)
+    return false;
+
+  if (s->npending) {
+    need = utf8_sequence_length(s->pending[0]);
+    n = need - s->npending;
+    if (n > len)
+      n = len;
+    memcpy(s->pending + s->npending, src, n);
+    s->npending += n;
+    s->offset += n;
+    src += n;
+    len -= n;
+
+    if (s->npending < need) {
+      if (!utf8_incomplete(s->pending, s->npending))
+        return utf8_stream_fail(s, s->offset - s->npending);
+      return true;
+    }
+    if (!utf8_check_scalar((const char *)s->pending, need, NULL))
+      return utf8_stream_fail(s, s->offset - need);
+    s->npending = 0;
+  }
+
+  switch (utf8_check_status(src, len, &cur)) {
+    case UTF8_OK:
+      break;
+    case UTF8_INCOMPLETE:
+      memcpy(s->pending, src + cur, len - cur);
+      s->npending = (unsigned char)(len - cur);
+      break;
+    case UTF8_INVALID:
+      return utf8_stream_fail(s, s->offset + cur);
+  }
+
+  s->offset += len;
+  s->cursor = s->offset - s->npending;
+  return true;
+}
+
+/*
+ * Ends the stream, a sequence that is still truncated is ill-formed.
+ */
+bool
+utf8_stream_finish(utf8_stream_t *s) {
+  if (s->failed)
+    return false;
+  if (s->npending)
+    return utf8_stream_fail(s, s->offset - s->npending);
+  return true;
+}
+
+/*
+ *    Fused validation
+ *
+ *    Functions that validate and convert the input work on blocks of
+ *    UTF8_VALID_BLOCK bytes. Each block is validated with utf8_check and
+ *    then converted while it is still in the first level cache, which
+ *    reads the input from memory once. The converters may therefore skip
+ *    every check that validation already made.
+ */
+
+#ifndef UTF8_VALID_BLOCK
+#define UTF8_VALID_BLOCK 16384
+#endif
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define UTF8_LE16(v) ((uint16_t)((uint16_t)(v) >> 8 | (uint16_t)(v) << 8))
+#else
+#define UTF8_LE16(v) ((uint16_t)(v))
+#endif
+
+/*
+ * Validates the next block of the input. Returns the length of the block
+ * that is well-formed, a block that is not the last one may end early at a
+ * sequence that continues in the next block. Sets *failed if the block
+ * ends at an ill-formed sequence.
+ */
+static inline size_t
+utf8_next_block(const char *src, size_t len, bool *failed) {
+  size_t n, cur;
+
+  n = len < UTF8_VALID_BLOCK ? len : UTF8_VALID_BLOCK;
+  switch (utf8_check_status(src, n, &cur)) {
+    case UTF8_OK:
+      *failed = false;
+      return n;
+    case UTF8_INCOMPLETE:
+      *failed = n == len;
+      return cur;
+    default:
+      *failed = true;
+      return cur;
+  }
+}
+
+/*
+ * Returns the number of bytes that are greater than the given byte when
+ * compared as signed bytes. The vector loop adds the compare results of
+ * up to 255 blocks per byte lane before summing the lanes with psadbw.
+ */
+static inline size_t
+utf8_count_above(const unsigned char *cur, const unsigned char *end, signed char byte) {
+  size_t count = 0;
+#ifdef UTF8_VALID_X86
+  const __m128i threshold = _mm_set1_epi8(byte);
+  __m128i acc, sum;
+  size_t i, n;
+
+  sum = _mm_setzero_si128();
+  while (end - cur >= 16) {
+    n = (end - cur) / 16;
+    if (n > 255)
+      n = 255;
+    acc = _mm_setzero_si128();
+    for (i = 0; i < n; i++, cur += 16)
+      acc = _mm_sub_epi8(acc, _mm_cmpgt_epi8(_mm_loadu_si128((const __m128i *)cur), threshold));
+    sum = _mm_add_epi64(sum, _mm_sad_epu8(acc, _mm_setzero_si128()));
+  }
+  count = (size_t)_mm_cvtsi128_si64(sum) + (size_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(sum, sum));
+#endif
+  for (; cur < end; cur++)
+    count += (signed char)*cur > byte;
+  return count;
+}
+
+/*
+ * Returns the number of code points in well-formed UTF-8, the number of
+ * bytes that are not continuation bytes.
+ */
+size_t
+utf8_count_codepoints(const char *src, size_t len) {
+  return utf8_count_above((const unsigned char *)src, (const unsigned char *)src + len, (signed char)0xBF);
+}
+
+/*
+ * Validates like utf8_check and counts the code points of the well-formed
+ * prefix in the same pass, so count is the number of code points before
+ * the cursor.
+ */
+bool
+utf8_check_count(const char *src, size_t len, size_t *cursor, size_t *count) {
+  const unsigned char *cur = (const unsigned char *)src;
+  size_t n, rem, total;
+  bool failed;
+
+  for (rem = len, total = 0, failed = false; rem && !failed; cur += n, rem -= n) {
+    n = utf8_next_block((const char *)cur, rem, &failed);
+    total += utf8_count_above(cur, cur + n, (signed char)0xBF);
+  }
+
+  if (cursor)
+    *cursor = (const char *)cur - src;
+  if (count)
+    *count = total;
+  return !failed;
+}
+
+/*
+ * Returns the number of UTF-16 code units of well-formed UTF-8, one for
+ * every byte that is not a continuation byte and one more for every lead
+ * byte of a four byte sequence. Both compares add to the same byte lanes,
+ * which are summed every 127 blocks.
+ */
+static inline size_t
+utf8_count_utf16(const unsigned char *cur, const unsigned char *end) {
+  size_t count = 0;
+#ifdef UTF8_VALID_X86
+  const __m128i cont = _mm_set1_epi8((char)0xBF);
+  const __m128i lead4 = _mm_set1_epi8((char)0xF0);
+  __m128i input, acc, sum;
+  size_t i, n;
+
+  sum = _mm_setzero_si128();
+  while (end - cur >= 16) {
+    n = (end - cur) / 16;
+    if (n > 127)
+      n = 127;
+    acc = _mm_setzero_si128();
+    for (i = 0; i < n; i++, cur += 16) {
+      input = _mm_loadu_si128((const __m128i *)cur);
+      acc = _mm_sub_epi8(acc, _mm_cmpgt_epi8(input, cont));
+      acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(_mm_min_epu8(input, lead4), lead4));
+    }
+    sum = _mm_add_epi64(sum, _mm_sad_epu8(acc, _mm_setzero_si128()));
+  }
+  count = (size_t)_mm_cvtsi128_si64(sum) + (size_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(sum, sum));
+#endif
+  for (; cur < end; cur++)
+    count += ((*cur & 0xC0) != 0x80) + (*cur >= 0xF0);
+  return count;
+}
+
+size_t
+utf8_utf16_length(const char *src, size_t len) {
+  return utf8_count_utf16((const unsigned char *)src, (const unsigned char *)src + len);
+}
+
+/*
+ * Validates like utf8_check and counts the UTF-16 code units of the
+ * well-formed prefix in the same pass.
+ */
+bool
+utf8_check_utf16_length(const char *src, size_t len, size_t *cursor, size_t *length) {
+  const unsigned char *cur = (const unsigned char *)src;
+  size_t n, rem, total;
+  bool failed;
+
+  for (rem = len, total = 0, failed = false; rem && !failed; cur += n, rem -= n) {
+    n = utf8_next_block((const char *)cur, rem, &failed);
+    total += utf8_count_utf16(cur, cur + n);
+  }
+
+  if (cursor)
+    *cursor = (const char *)cur - src;
+  if (length)
+    *length = total;
+  return !failed;
+}
+
+/*
+ * Decodes the well-formed sequence at cur, returns its length.
+ */
+static inline size_t
+utf8_decode(const unsigned char *cur, uint32_t *ord) {
+  uint32_t v = cur[0];
+
+  if (v < 0x80) {
+    *ord = v;
+    return 1;
+  }
+  if (v < 0xE0) {
+    *ord = (v & 0x1F) << 6 | (cur[1] & 0x3F);
+    return 2;
+  }
+  if (v < 0xF0) {
+    *ord = (v & 0x0F) << 12 | (cur[1] & 0x3F) << 6 | (cur[2] & 0x3F);
+    return 3;
+  }
+  *ord = (v & 0x07) << 18 | (cur[1] & 0x3F) << 12 | (cur[2] & 0x3F) << 6 | (cur[3] & 0x3F);
+  return 4;
+}
+
+#ifdef UTF8_VALID_X86
+/*
+ *    Vector decoding
+ *
+ *    The input is decoded 16 bytes at a time, each window decodes the
+ *    sequences that start in it and skips the continuation bytes of the one
+ *    that started before. Each byte is masked to its payload by the length
+ *    its high nibble gives, and each lead byte combines its payload with
+ *    the payloads of the two bytes after it into a code point. The code
+ *    points at the lead bytes are packed eight lanes at a time with a
+ *    shuffle. A window ends at its first four byte sequence, which is
+ *    decoded by the scalar decoder.
+ */
+
+/* Payload mask of a byte by its high nibble */
+static const unsigned char utf8_payload_mask[16] = {
+  0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F,
+  0x3F, 0x3F, 0x3F, 0x3F, 0x1F, 0x1F, 0x0F, 0x07
+};
+
+/*
+ * Byte offsets of the 16-bit lanes set in an eight bit mask, in the order
+ * of the lanes. The low nibble of each byte holds an offset, the high
+ * nibble of the first byte the number of lanes.
+ */
+static const uint64_t utf8_pack_lanes[256] = {
+  0x0000000000000000ULL, 0x0000000000000010ULL, 0x0000000000000012ULL, 0x0000000000000220ULL,
+  0x0000000000000014ULL, 0x0000000000000420ULL, 0x0000000000000422ULL, 0x0000000000040230ULL,
+  0x0000000000000016ULL, 0x0000000000000620ULL, 0x0000000000000622ULL, 0x0000000000060230ULL,
+  0x0000000000000624ULL, 0x0000000000060430ULL, 0x0000000000060432ULL, 0x0000000006040240ULL,
+  0x0000000000000018ULL, 0x0000000000000820ULL, 0x0000000000000822ULL, 0x0000000000080230ULL,
+  0x0000000000000824ULL, 0x0000000000080430ULL, 0x0000000000080432ULL, 0x0000000008040240ULL,
+  0x0000000000000826ULL, 0x0000000000080630ULL, 0x0000000000080632ULL, 0x0000000008060240ULL,
+  0x0000000000080634ULL, 0x0000000008060440ULL, 0x0000000008060442ULL, 0x0000000806040250ULL,
+  0x000000000000001AULL, 0x0000000000000A20ULL, 0x0000000000000A22ULL, 0x00000000000A0230ULL,
+  0x0000000000000A24ULL, 0x00000000000A0430ULL, 0x00000000000A0432ULL, 0x000000000A040240ULL,
+  0x0000000000000A26ULL, 0x00000000000A0630ULL, 0x00000000000A0632ULL, 0x000000000A060240ULL,
+  0x00000000000A0634ULL, 0x000000000A060440ULL, 0x000000000A060442ULL, 0x0000000A06040250ULL,
+  0x0000000000000A28ULL, 0x00000000000A0830ULL, 0x00000000000A0832ULL, 0x000000000A080240ULL,
+  0x00000000000A0834ULL, 0x000000000A080440ULL, 0x000000000A080442ULL, 0x0000000A08040250ULL,
+  0x00000000000A0836ULL, 0x000000000A080640ULL, 0x000000000A080642ULL, 0x0000000A08060250ULL,
+  0x000000000A080644ULL, 0x0000000A08060450ULL, 0x0000000A08060452ULL, 0x00000A0806040260ULL,
+  0x000000000000001CULL, 0x0000000000000C20ULL, 0x0000000000000C22ULL, 0x00000000000C0230ULL,
+  0x0000000000000C24ULL, 0x00000000000C0430ULL, 0x00000000000C0432ULL, 0x000000000C040240ULL,
+  0x0000000000000C26ULL, 0x00000000000C0630ULL, 0x00000000000C0632ULL, 0x000000000C060240ULL,
+  0x00000000000C0634ULL, 0x000000000C060440ULL, 0x000000000C060442ULL, 0x0000000C06040250ULL,
+  0x0000000000000C28ULL, 0x00000000000C0830ULL, 0x00000000000C0832ULL, 0x000000000C080240ULL,
+  0x00000000000C0834ULL, 0x000000000C080440ULL, 0x000000000C080442ULL, 0x0000000C08040250ULL,
+  0x00000000000C0836ULL, 0x000000000C080640ULL, 0x000000000C080642ULL, 0x0000000C08060250ULL,
+  0x000000000C080644ULL, 0x0000000C08060450ULL, 0x0000000C08060452ULL, 0x00000C0806040260ULL,
+  0x0000000000000C2AULL, 0x00000000000C0A30ULL, 0x00000000000C0A32ULL, 0x000000000C0A0240ULL,
+  0x00000000000C0A34ULL, 0x000000000C0A0440ULL, 0x000000000C0A0442ULL, 0x0000000C0A040250ULL,
+  0x00000000000C0A36ULL, 0x000000000C0A0640ULL, 0x000000000C0A0642ULL, 0x0000000C0A060250ULL,
+  0x000000000C0A0644ULL, 0x0000000C0A060450ULL, 0x0000000C0A060452ULL, 0x00000C0A06040260ULL,
+  0x00000000000C0A38ULL, 0x000000000C0A0840ULL, 0x000000000C0A0842ULL, 0x0000000C0A080250ULL,
+  0x000000000C0A0844ULL, 0x0000000C0A080450ULL, 0x0000000C0A080452ULL, 0x00000C0A08040260ULL,
+  0x000000000C0A0846ULL, 0x0000000C0A080650ULL, 0x0000000C0A080652ULL, 0x00000C0A08060260ULL,
+  0x0000000C0A080654ULL, 0x00000C0A08060460ULL, 0x00000C0A08060462ULL, 0x000C0A0806040270ULL,
+  0x000000000000001EULL, 0x0000000000000E20ULL, 0x0000000000000E22ULL, 0x00000000000E0230ULL,
+  0x0000000000000E24ULL, 0x00000000000E0430ULL, 0x00000000000E0432ULL, 0x000000000E040240ULL,
+  0x0000000000000E26ULL, 0x00000000000E0630ULL, 0x00000000000E0632ULL, 0x000000000E060240ULL,
+  0x00000000000E0634ULL, 0x000000000E060440ULL, 0x000000000E060442ULL, 0x0000000E06040250ULL,
+  0x0000000000000E28ULL, 0x00000000000E0830ULL, 0x00000000000E0832ULL, 0x000000000E080240ULL,
+  0x00000000000E0834ULL, 0x000000000E080440ULL, 0x000000000E080442ULL, 0x0000000E08040250ULL,
+  0x00000000000E0836ULL, 0x000000000E080640ULL, 0x000000000E080642ULL, 0x0000000E08060250ULL,
+  0x000000000E080644ULL, 0x0000000E08060450ULL, 0x0000000E08060452ULL, 0x00000E0806040260ULL,
+  0x0000000000000E2AULL, 0x00000000000E0A30ULL, 0x00000000000E0A32ULL, 0x000000000E0A0240ULL,
+  0x00000000000E0A34ULL, 0x000000000E0A0440ULL, 0x000000000E0A0442ULL, 0x0000000E0A040250ULL,
+  0x00000000000E0A36ULL, 0x000000000E0A0640ULL, 0x000000000E0A0642ULL, 0x0000000E0A060250ULL,
+  0x000000000E0A0644ULL, 0x0000000E0A060450ULL, 0x0000000E0A060452ULL, 0x00000E0A06040260ULL,
+  0x00000000000E0A38ULL, 0x000000000E0A0840ULL, 0x000000000E0A0842ULL, 0x0000000E0A080250ULL,
+  0x000000000E0A0844ULL, 0x0000000E0A080450ULL, 0x0000000E0A080452ULL, 0x00000E0A08040260ULL,
+  0x000000000E0A0846ULL, 0x0000000E0A080650ULL, 0x0000000E0A080652ULL, 0x00000E0A08060260ULL,
+  0x0000000E0A080654ULL, 0x00000E0A08060460ULL, 0x00000E0A08060462ULL, 0x000E0A0806040270ULL,
+  0x0000000000000E2CULL, 0x00000000000E0C30ULL, 0x00000000000E0C32ULL, 0x000000000E0C0240ULL,
+  0x00000000000E0C34ULL, 0x000000000E0C0440ULL, 0x000000000E0C0442ULL, 0x0000000E0C040250ULL,
+  0x00000000000E0C36ULL, 0x000000000E0C0640ULL, 0x000000000E0C0642ULL, 0x0000000E0C060250ULL,
+  0x000000000E0C0644ULL, 0x0000000E0C060450ULL, 0x0000000E0C060452ULL, 0x00000E0C06040260ULL,
+  0x00000000000E0C38ULL, 0x000000000E0C0840ULL, 0x000000000E0C0842ULL, 0x0000000E0C080250ULL,
+  0x000000000E0C0844ULL, 0x0000000E0C080450ULL, 0x0000000E0C080452ULL, 0x00000E0C08040260ULL,
+  0x000000000E0C0846ULL, 0x0000000E0C080650ULL, 0x0000000E0C080652ULL, 0x00000E0C08060260ULL,
+  0x0000000E0C080654ULL, 0x00000E0C08060460ULL, 0x00000E0C08060462ULL, 0x000E0C0806040270ULL,
+  0x00000000000E0C3AULL, 0x000000000E0C0A40ULL, 0x000000000E0C0A42ULL, 0x0000000E0C0A0250ULL,
+  0x000000000E0C0A44ULL, 0x0000000E0C0A0450ULL, 0x0000000E0C0A0452ULL, 0x00000E0C0A040260ULL,
+  0x000000000E0C0A46ULL, 0x0000000E0C0A0650ULL, 0x0000000E0C0A0652ULL, 0x00000E0C0A060260ULL,
+  0x0000000E0C0A0654ULL, 0x00000E0C0A060460ULL, 0x00000E0C0A060462ULL, 0x000E0C0A06040270ULL,
+  0x000000000E0C0A48ULL, 0x0000000E0C0A0850ULL, 0x0000000E0C0A0852ULL, 0x00000E0C0A080260ULL,
+  0x0000000E0C0A0854ULL, 0x00000E0C0A080460ULL, 0x00000E0C0A080462ULL, 0x000E0C0A08040270ULL,
+  0x0000000E0C0A0856ULL, 0x00000E0C0A080660ULL, 0x00000E0C0A080662ULL, 0x000E0C0A08060270ULL,
+  0x00000E0C0A080664ULL, 0x000E0C0A08060470ULL, 0x000E0C0A08060472ULL, 0x0E0C0A0806040280ULL
+};
+
+/*
+ * Decodes the sequences that start in the 16 bytes at cur, of which at
+ * least 18 bytes can be read, up to the first four byte sequence. Sets *leads to the mask of the bytes that start a decoded
+ * sequence, and lo and hi to the code points of the sequences that start
+ * at the 16 bytes. Returns the number of bytes decoded, 16 or the offset
+ * of the four byte sequence.
+ */
+__attribute__((target("sse4.1")))
+static inline size_t
+utf8_sse4_decode(const unsigned char *cur, __m128i *lo, __m128i *hi, unsigned *leads) {
+  const __m128i cont = _mm_set1_epi8(0x3F);
+  __m128i input, ascii, three, payload, next1, next2, last, mid, top, low, high;
+  unsigned four;
+  size_t n;
+
+  input = _mm_loadu_si128((const __m128i *)cur);
+  four = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(input, _mm_set1_epi8((char)0xF0)), input));
+  n = four ? (size_t)__builtin_ctz(four) : 16;
+
+  ascii = _mm_cmpgt_epi8(input, _mm_set1_epi8(-1));
+  three = _mm_cmpgt_epi8(input, _mm_set1_epi8((char)0xDF));
+  payload = _mm_and_si128(input, _mm_shuffle_epi8(
+    _mm_loadu_si128((const __m128i *)utf8_payload_mask),
+    _mm_and_si128(_mm_srli_epi16(input, 4), _mm_set1_epi8(0x0F))));
+  next1 = _mm_and_si128(_mm_loadu_si128((const __m128i *)(cur + 1)), cont);
+  next2 = _mm_and_si128(_mm_loadu_si128((const __m128i *)(cur + 2)), cont);
+
+  /*
+   * The last payload gives bits 0-5, the one before it bits 6-11 and the
+   * payload of a three byte lead bits 12-15. The signed compare sets three
+   * for ASCII bytes as well, which keep only their own payload.
+   */
+  last = _mm_blendv_epi8(_mm_blendv_epi8(next1, next2, three), payload, ascii);
+  mid = _mm_andnot_si128(ascii, _mm_blendv_epi8(payload, next1, three));
+  top = _mm_andnot_si128(ascii, _mm_and_si128(three, payload));
+  low = _mm_or_si128(last, _mm_and_si128(_mm_slli_epi16(mid, 6), _mm_set1_epi8((char)0xC0)));
+  high = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(mid, 2), _mm_set1_epi8(0x0F)),
+    _mm_and_si128(_mm_slli_epi16(top, 4), _mm_set1_epi8((char)0xF0)));
+
+  *lo = _mm_unpacklo_epi8(low, high);
+  *hi = _mm_unpackhi_epi8(low, high);
+  *leads = ~_mm_movemask_epi8(_mm_cmplt_epi8(input, _mm_set1_epi8((char)0xC0))) & ((1u << n) - 1);
+  return n;
+}
+
+/*
+ * Returns the first byte at or after cur that starts a sequence.
+ */
+static inline const unsigned char *
+utf8_next_lead(const unsigned char *cur) {
+  while ((*cur & 0xC0) == 0x80)
+    cur++;
+  return cur;
+}
+
+/*
+ * Moves the lanes of v given by a row of utf8_pack_lanes to the front.
+ */
+__attribute__((target("sse4.1")))
+static inline __m128i
+utf8_sse4_pack(__m128i v, uint64_t lanes) {
+  __m128i idx = _mm_and_si128(_mm_cvtsi64_si128((long long)lanes), _mm_set1_epi8(0x0F));
+
+  return _mm_shuffle_epi8(v, _mm_add_epi16(_mm_unpacklo_epi8(idx, idx), _mm_set1_epi16(0x0100)));
+}
+
+/*
+ * Stores the code points of the lanes of v that are set in the eight bit
+ * mask m as UTF-16LE, writes eight code units.
+ */
+__attribute__((target("sse4.1")))
+static inline uint16_t *
+utf8_sse4_pack_utf16le(uint16_t *d, __m128i v, unsigned m) {
+  uint64_t lanes = utf8_pack_lanes[m];
+
+  _mm_storeu_si128((__m128i *)d, utf8_sse4_pack(v, lanes));
+  return d + (lanes >> 4 & 0xF);
+}
+
+/*
+ * Stores the code points of the lanes of v that are set in the eight bit
+ * mask m as UTF-32, writes eight code points.
+ */
+__attribute__((target("sse4.1")))
+static inline uint32_t *
+utf8_sse4_pack_utf32(uint32_t *d, __m128i v, unsigned m) {
+  uint64_t lanes = utf8_pack_lanes[m];
+
+  v = utf8_sse4_pack(v, lanes);
+  _mm_storeu_si128((__m128i *)d, _mm_cvtepu16_epi32(v));
+  _mm_storeu_si128((__m128i *)(d + 4), _mm_cvtepu16_epi32(_mm_srli_si128(v, 8)));
+  return d + (lanes >> 4 & 0xF);
+}
+
+/*
+ * Returns true if the conversions use the vector decoder, which needs the
+ * SSE4.1 that every vector kernel implies and follows the kernel selected
+ * for utf8_check.
+ */
+static inline bool
+utf8_decode_vector(void) {
+  switch (utf8_kernel()) {
+    case UTF8_KERNEL_SSE4:
+    case UTF8_KERNEL_AVX2:
+    case UTF8_KERNEL_AVX512:
+      return true;
+    default:
+      return false;
+  }
+}
+#endif
+
+/*
+ * Converts well-formed UTF-8 to UTF-16LE.
+ */
+static inline size_t
+utf8_decode_utf16le(const unsigned char *cur, const unsigned char *end, uint16_t *dst) {
+  uint16_t *d = dst;
+  uint32_t v;
+#ifdef UTF8_VALID_X86
+  __m128i input;
+#endif
+
+  while (cur < end) {
+#ifdef UTF8_VALID_X86
+    if (end - cur >= 16) {
+      input = _mm_loadu_si128((const __m128i *)cur);
+      if (_mm_movemask_epi8(input) == 0) {
+        _mm_storeu_si128((__m128i *)d, _mm_unpacklo_epi8(input, _mm_setzero_si128()));
+        _mm_storeu_si128((__m128i *)(d + 8), _mm_unpackhi_epi8(input, _mm_setzero_si128()));
+        cur += 16;
+        d += 16;
+        continue;
+      }
+    }
+#endif
+    cur += utf8_decode(cur, &v);
+    if (v >= 0x10000) {
+      v -= 0x10000;
+      *d++ = UTF8_LE16(0xD800 | v >> 10);
+      v = 0xDC00 | (v & 0x3FF);
+    }
+    *d++ = UTF8_LE16(v);
+  }
+  return d - dst;
+}
+
+#ifdef UTF8_VALID_X86
+/*
+ * Converts well-formed UTF-8 to UTF-16LE with the vector decoder. A window
+ * is only decoded with at least 64 bytes left, whose at least 16 code
+ * units leave room for the eight that every pack writes.
+ */
+__attribute__((target("sse4.1")))
+static inline size_t
+utf8_decode_utf16le_sse4(const unsigned char *cur, const unsigned char *end, uint16_t *dst) {
+  uint16_t *d = dst;
+  __m128i input, lo, hi;
+  unsigned leads;
+  size_t n;
+
+  while (end - cur >= 64) {
+    input = _mm_loadu_si128((const __m128i *)cur);
+    if (_mm_movemask_epi8(input) == 0) {
+      _mm_storeu_si128((__m128i *)d, _mm_cvtepu8_epi16(input));
+      _mm_storeu_si128((__m128i *)(d + 8), _mm_cvtepu8_epi16(_mm_srli_si128(input, 8)));
+      cur += 16;
+      d += 16;
+      continue;
+    }
+    n = utf8_sse4_decode(cur, &lo, &hi, &leads);
+    d = utf8_sse4_pack_utf16le(d, lo, leads & 0xFF);
+    d = utf8_sse4_pack_utf16le(d, hi, leads >> 8);
+    cur += n;
+    if (n < 16) {
+      d += utf8_decode_utf16le(cur, cur + 4, d);
+      cur += 4;
+    }
+  }
+  cur = utf8_next_lead(cur);
+  return d - dst + utf8_decode_utf16le(cur, end, d);
+}
+#endif
+
+/*
+ * Converts UTF-8 to UTF-16LE, dst must have room for utf8_utf16_length
+ * code units. Returns the number of code units written to dst, the
+ * conversion stops at the first ill-formed sequence. If cursor is not
+ * NULL it is set to the offset of that sequence, or len if src is
+ * well-formed.
+ */
+size_t
+utf8_to_utf16le(const char *src, size_t len, uint16_t *dst, size_t *cursor) {
+  const unsigned char *cur = (const unsigned char *)src;
+  size_t (*decode)(const unsigned char *, const unsigned char *, uint16_t *) = utf8_decode_utf16le;
+  uint16_t *d = dst;
+  size_t n, rem;
+  bool failed;
+
+#ifdef UTF8_VALID_X86
+  if (utf8_decode_vector())
+    decode = utf8_decode_utf16le_sse4;
+#endif
+
+  for (rem = len, failed = false; rem && !failed; cur += n, rem -= n) {
+    n = utf8_next_block((const char *)cur, rem, &failed);
+    d += decode(cur, cur + n, d);
+  }
+
+  if (cursor)
+    *cursor = (const char *)cur - src;
+  return d - dst;
+}
+
+/*
+ * Converts well-formed UTF-8 to UTF-32.
+ */
+static inline size_t
+utf8_decode_utf32(const unsigned char *cur, const unsigned char *end, uint32_t *dst) {
+  uint32_t *d = dst;
+#ifdef UTF8_VALID_X86
+  const __m128i zero = _mm_setzero_si128();
+  __m128i input, lo, hi;
+#endif
+
+  while (cur < end) {
+#ifdef UTF8_VALID_X86
+    if (end - cur >= 16) {
+      input = _mm_loadu_si128((const __m128i *)cur);
+      if (_mm_movemask_epi8(input) == 0) {
+        lo = _mm_unpacklo_epi8(input, zero);
+        hi = _mm_unpackhi_epi8(input, zero);
+        _mm_storeu_si128((__m128i *)d, _mm_unpacklo_epi16(lo, zero));
+        _mm_storeu_si128((__m128i *)(d + 4), _mm_unpackhi_epi16(lo, zero));
+        _mm_storeu_si128((__m128i *)(d + 8), _mm_unpacklo_epi16(hi, zero));
+        _mm_storeu_si128((__m128i *)(d + 12), _mm_unpackhi_epi16(hi, zero));
+        cur += 16;
+        d += 16;
+        continue;
+      }
+    }
+#endif
+    cur += utf8_decode(cur, d++);
+  }
+  return d - dst;
+}
+
+#ifdef UTF8_VALID_X86
+/*
+ * Converts well-formed UTF-8 to UTF-32 with the vector decoder. A window
+ * is only decoded with at least 64 bytes left, whose at least 16 code
+ * points leave room for the eight that every pack writes.
+ */
+__attribute__((target("sse4.1")))
+static inline size_t
+utf8_decode_utf32_sse4(const unsigned char *cur, const unsigned char *end, uint32_t *dst) {
+  uint32_t *d = dst;
+  const __m128i zero = _mm_setzero_si128();
+  __m128i input, lo, hi;
+  unsigned leads;
+  size_t n;
+
+  while (end - cur >= 64) {
+    input = _mm_loadu_si128((const __m128i *)cur);
+    if (_mm_movemask_epi8(input) == 0) {
+      lo = _mm_unpacklo_epi8(input, zero);
+      hi = _mm_unpackhi_epi8(input, zero);
+      _mm_storeu_si128((__m128i *)d, _mm_unpacklo_epi16(lo, zero));
+      _mm_storeu_si128((__m128i *)(d + 4), _mm_unpackhi_epi16(lo, zero));
+      _mm_storeu_si128((__m128i *)(d + 8), _mm_unpacklo_epi16(hi, zero));
+      _mm_storeu_si128((__m128i *)(d + 12), _mm_unpackhi_epi16(hi, zero));
+      cur += 16;
+      d += 16;
+      continue;
+    }
+    n = utf8_sse4_decode(cur, &lo, &hi, &leads);
+    d = utf8_sse4_pack_utf32(d, lo, leads & 0xFF);
+    d = utf8_sse4_pack_utf32(d, hi, leads >> 8);
+    cur += n;
+    if (n < 16) {
+      d += utf8_decode_utf32(cur, cur + 4, d);
+      cur += 4;
+    }
+  }
+  cur = utf8_next_lead(cur);
+  return d - dst + utf8_decode_utf32(cur, end, d);
+}
+#endif
+
+/*
+ * Converts UTF-8 to UTF-32 in native byte order, dst must have room for
+ * a code point for every byte of src that is not a continuation byte.
+ * Returns the number of code points written to dst,
+ * the conversion stops at the first ill-formed sequence. If cursor is not
+ * NULL it is set to the offset of that sequence, or len if src is
+ * well-formed.
+ */
+size_t
+utf8_to_utf32(const char *src, size_t len, uint32_t *dst, size_t *cursor) {
+  const unsigned char *cur = (const unsigned char *)src;
+  size_t (*decode)(const unsigned char *, const unsigned char *, uint32_t *) = utf8_decode_utf32;
+  uint32_t *d = dst;
+  size_t n, rem;
+  bool failed;
+
+#ifdef UTF8_VALID_X86
+  if (utf8_decode_vector())
+    decode = utf8_decode_utf32_sse4;
+#endif
+
+  for (rem = len, failed = false; rem && !failed; cur += n, rem -= n) {
+    n = utf8_next_block((const char *)cur, rem, &failed);
+    d += decode(cur, cur + n, d);
+  }
+
+  if (cursor)
+    *cursor = (const char *)cur - src;
+  return d - dst;
+}
+
+/*
+ *    Error scanning
+ *
+ *    Finds every maximal subpart of an ill-formed sequence in one pass of
+ *    the selected kernel. The vector kernels resume after a subpart in
+ *    their block loop and the scalar decoder right after it, the DFA
+ *    kernels share the chunked scan of the shift DFA.
+ */
+
+/*
+ * Calls fn with the offset and length of every maximal subpart of an
+ * ill-formed sequence, in order. No byte before the end of a subpart is
+ * read after it is reported, so fn may overwrite it. Returns the number
+ * of subparts.
+ */
+static inline size_t
+utf8_scan(const char *src, size_t len, utf8_scan_fn fn, void *ctx) {
+  if (len < UTF8_VALID_SHORT && utf8_ascii_short((const unsigned char *)src, len))
+    return 0;
+
+  switch (utf8_kernel()) {
+    case UTF8_KERNEL_SCALAR: return utf8_scan_scalar(src, len, fn, ctx);
+#ifdef UTF8_VALID_X86
+    case UTF8_KERNEL_SSE4:   return utf8_scan_sse4(src, len, NULL, fn, ctx);
+    case UTF8_KERNEL_AVX2:   return utf8_scan_avx2(src, len, NULL, fn, ctx);
+    case UTF8_KERNEL_AVX512: return utf8_scan_avx512(src, len, NULL, fn, ctx);
+#endif
+    default:                 return utf8_scan_shift_dfa(src, len, fn, ctx);
+  }
+}
+
+/*
+ *    Sanitization
+ *
+ *    Replaces every maximal subpart of an ill-formed sequence, as returned
+ *    by utf8_maximal_subpart, with U+FFFD REPLACEMENT CHARACTER, which is
+ *    the practice recommended by the Unicode Standard. The subparts are
+ *    found in one pass with utf8_scan, and the well-formed runs between
+ *    them are copied with memcpy.
+ */
+
+/*
+ * Appends n bytes of well-formed UTF-8 to dst. A run that does not fit is
+ * cut at a sequence boundary, and nothing is written after it.
+ */
+static inline void
+utf8_sanitize_append(char *dst, size_t dstcap, size_t *written, size_t *total,
+                     const char *src, size_t n) {
+  size_t m = n;
+
+  if (*written == *total) {
+    if (m > dstcap - *written)
+      m = utf8_resync(src, n, dstcap - *written);
+    if (m)
+      memcpy(dst + *written, src, m);
+    *written += m;
+  }
+  *total += n;
+}
+
+typedef struct {
+  const char *src;
+  size_t off;       /* end of the last subpart */
+  char *dst;
+  size_t dstcap;
+  size_t *written;
+  size_t total;
+} utf8_sanitize_t;
+
+static void
+utf8_sanitize_replace(void *ctx, size_t offset, size_t length) {
+  utf8_sanitize_t *s = (utf8_sanitize_t *)ctx;
+
+  utf8_sanitize_append(s->dst, s->dstcap, s->written, &s->total,
+    s->src + s->off, offset - s->off);
+  utf8_sanitize_append(s->dst, s->dstcap, s->written, &s->total, "\xEF\xBF\xBD", 3);
+  s->off = offset + length;
+}
+
+static inline size_t
+utf8_sanitize_into(const char *src, size_t len, char *dst, size_t dstcap, size_t *written) {
+  utf8_sanitize_t s;
+
+  s.src = src;
+  s.off = 0;
+  s.dst = dst;
+  s.dstcap = dstcap;
+  s.written = written;
+  s.total = 0;
+  *written = 0;
+  utf8_scan(src, len, utf8_sanitize_replace, &s);
+  utf8_sanitize_append(dst, dstcap, written, &s.total, src + s.off, len - s.off);
+  return s.total;
+}
+
+/*
+ * Returns the number of bytes of the sanitized input.
+ */
+size_t
+utf8_sanitize_length(const char *src, size_t len) {
+  size_t written;
+
+  return utf8_sanitize_into(src, len, NULL, 0, &written);
+}
+
+/*
+ * Writes the sanitized input to dst, which is always well-formed. Returns
+ * the number of bytes written, if that is less than utf8_sanitize_length
+ * the output was cut at a sequence boundary to fit in dstcap bytes.
+ */
+size_t
+utf8_sanitize(const char *src, size_t len, char *dst, size_t dstcap) {
+  size_t written;
+
+  utf8_sanitize_into(src, len, dst, dstcap, &written);
+  return written;
+}
+
+typedef struct {
+  char *buf;
+  char replacement;
+} utf8_sanitize_inplace_t;
+
+static void
+utf8_sanitize_overwrite(void *ctx, size_t offset, size_t length) {
+  utf8_sanitize_inplace_t *s = (utf8_sanitize_inplace_t *)ctx;
+
+  memset(s->buf + offset, s->replacement, length);
+}
+
+/*
+ * Overwrites every byte of each maximal subpart of an ill-formed sequence
+ * with the given replacement byte, which should be ASCII for the result to
+ * be well-formed. The length is unchanged. Returns the number of maximal
+ * subparts that were replaced.
+ */
+size_t
+utf8_sanitize_inplace(char *buf, size_t len, char replacement) {
+  utf8_sanitize_inplace_t s;
+
+  s.buf = buf;
+  s.replacement = replacement;
+  return utf8_scan(buf, len, utf8_sanitize_overwrite, &s);
+}
+
+/*
+ *    Errors
+ *
+ *    An ill-formed sequence is classified by its first two bytes and the
+ *    number of continuation bytes that follow the lead byte, following
+ *    the rows of the table at the top of this file.
+ */
+
+typedef enum {
+  UTF8_ERROR_NONE = 0,
+  UTF8_ERROR_OVERLONG,      /* E0 80..9F, F0 80..8F */
+  UTF8_ERROR_SURROGATE,     /* ED A0..BF */
+  UTF8_ERROR_TOO_LARGE,     /* F4 90..BF */
+  UTF8_ERROR_CONTINUATION,  /* 80..BF without a lead byte */
+  UTF8_ERROR_TRUNCATED,     /* too few continuation bytes */
+  UTF8_ERROR_INVALID_LEAD   /* C0..C1, F5..FF */
+} utf8_error_kind_t;
+
+typedef struct {
+  size_t offset;
+  size_t length;
+  utf8_error_kind_t kind;
+} utf8_error_t;
+
+const char *
+utf8_error_name(utf8_error_kind_t kind) {
+  switch (kind) {
+    case UTF8_ERROR_NONE:         return "none";
+    case UTF8_ERROR_OVERLONG:     return "overlong";
+    case UTF8_ERROR_SURROGATE:    return "surrogate";
+    case UTF8_ERROR_TOO_LARGE:    return "too large";
+    case UTF8_ERROR_CONTINUATION: return "continuation";
+    case UTF8_ERROR_TRUNCATED:    return "truncated";
+    case UTF8_ERROR_INVALID_LEAD: return "invalid lead";
+  }
+  return "unknown";
+}
+
+/*
+ * Classifies the sequence at the start of src, typically at the cursor
+ * returned by utf8_check. Returns UTF8_ERROR_NONE if it is well-formed.
+ */
+utf8_error_kind_t
+utf8_error_kind(const char *src, size_t len) {
+  const unsigned char *cur = (const unsigned char *)src;
+  size_t i, n;
+
+  if (len == 0 || cur[0] < 0x80)
+    return UTF8_ERROR_NONE;
+  if (cur[0] < 0xC0)
+    return UTF8_ERROR_CONTINUATION;
+  if (cur[0] < 0xC2 || cur[0] > 0xF4)
+    return UTF8_ERROR_INVALID_LEAD;
+  if (len < 2 || (cur[1] & 0xC0) != 0x80)
+    return UTF8_ERROR_TRUNCATED;
+
+  switch (cur[0]) {
+    case 0xE0: if (cur[1] < 0xA0) return UTF8_ERROR_OVERLONG; break;
+    case 0xED: if (cur[1] > 0x9F) return UTF8_ERROR_SURROGATE; break;
+    case 0xF0: if (cur[1] < 0x90) return UTF8_ERROR_OVERLONG; break;
+    case 0xF4: if (cur[1] > 0x8F) return UTF8_ERROR_TOO_LARGE; break;
+  }
+
+  n = utf8_sequence_length(cur[0]);
+  for (i = 2; i < n; i++) {
+    if (i >= len || (cur[i] & 0xC0) != 0x80)
+      return UTF8_ERROR_TRUNCATED;
+  }
+  return UTF8_ERROR_NONE;
+}
+
+/*
+ * Validates like utf8_check. If src is ill-formed, error receives the
+ * offset, the length of the maximal subpart, and the kind of the first
+ * ill-formed sequence.
+ */
+bool
+utf8_check_error(const char *src, size_t len, utf8_error_t *error) {
+  size_t cur;
+
+  if (utf8_check(src, len, &cur))
+    return true;
+
+  if (error) {
+    error->offset = cur;
+    error->length = utf8_maximal_subpart(src + cur, len - cur);
+    error->kind = utf8_error_kind(src + cur, len - cur);
+  }
+  return false;
+}
+
+typedef struct {
+  const char *src;
+  size_t len;
+  utf8_error_t *errors;
+  size_t max;
+  size_t count;
+} utf8_find_errors_t;
+
+static void
+utf8_find_errors_add(void *ctx, size_t offset, size_t length) {
+  utf8_find_errors_t *f = (utf8_find_errors_t *)ctx;
+
+  if (f->count < f->max) {
+    f->errors[f->count].offset = offset;
+    f->errors[f->count].length = length;
+    f->errors[f->count].kind = utf8_error_kind(f->src + offset, f->len - offset);
+  }
+  f->count++;
+}
+
+/*
+ * Finds every maximal subpart of an ill-formed sequence in one pass with
+ * utf8_scan. Stores the first max subparts in errors, and returns the
+ * number of subparts in the whole input.
+ */
+size_t
+utf8_find_errors(const char *src, size_t len, utf8_error_t *errors, size_t max) {
+  utf8_find_errors_t f;
+
+  f.src = src;
+  f.len = len;
+  f.errors = errors;
+  f.max = max;
+  f.count = 0;
+  return utf8_scan(src, len, utf8_find_errors_add, &f);
 }
 
 #ifdef __cplusplus
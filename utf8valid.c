@@ -0,0 +1,907 @@
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include "utf8_valid.h"
+
+/*
+ *  utf8valid [-a] [-q] [-r] [-j threads] [file ...]
+ *
+ *  Validates files as UTF-8 and prints the byte offset, line and column of
+ *  the first ill-formed sequence of every file, or of every ill-formed
+ *  sequence with -a. Lines and columns count from 1, columns in characters.
+ *  The standard input is read when no file or "-" is given.
+ *
+ *  Regular files are mapped a window at a time with MAP_POPULATE, and the
+ *  next window is read ahead while the current one is validated. Other
+ *  files, such as pipes, are read in chunks. Lines are only counted when
+ *  an error is reported, so a well-formed mapped file is read once.
+ *
+ *  With -r directories are walked and files are validated by a pool of
+ *  threads, one per online CPU unless -j is given, and a summary with the
+ *  aggregate throughput is printed to the standard error. Symbolic links
+ *  and files other than regular files are skipped in the walk.
+ *
+ *  Exits with 0 if every file is well-formed, 1 if any is not and 2 on
+ *  errors such as a file that can't be read.
+ */
+
+#define WINDOW ((size_t)64 << 20)
+#define CHUNK  ((size_t)1 << 20)
+
+static bool OptAll;
+static bool OptQuiet;
+static bool OptRecurse;
+static unsigned OptThreads;
+
+typedef struct {
+  unsigned long long offset;  /* bytes counted so far */
+  unsigned long long line;    /* line at offset, from 1 */
+  unsigned long long column;  /* characters from the start of the line to offset */
+} position_t;
+
+typedef struct {
+  const char *path;
+  int fd;
+  position_t pos;
+  unsigned long long errors;
+} file_t;
+
+/*
+ * Moves the position over the len bytes at src.
+ */
+static void
+position_advance(position_t *p, const char *src, size_t len) {
+  const char *end = src + len;
+  const char *nl;
+
+  while ((nl = memchr(src, '\n', end - src)) != NULL) {
+    p->line++;
+    p->column = 0;
+    src = nl + 1;
+  }
+  for (; src < end; src++)
+    p->column += (*src & 0xC0) != 0x80;
+  p->offset += len;
+}
+
+/*
+ * Moves the position of the file to target, the bytes from base are at src.
+ * Bytes before base, in an earlier window of a mapped file, are read again.
+ */
+static bool
+position_seek(file_t *f, const char *src, unsigned long long base,
+              unsigned long long target) {
+  char buf[1 << 16];
+  ssize_t n;
+
+  while (f->pos.offset < base) {
+    n = pread(f->fd, buf, base - f->pos.offset < sizeof(buf) ?
+      base - f->pos.offset : sizeof(buf), f->pos.offset);
+    if (n <= 0)
+      return false;
+    position_advance(&f->pos, buf, n);
+  }
+  if (target > f->pos.offset)
+    position_advance(&f->pos, src + (f->pos.offset - base), target - f->pos.offset);
+  return true;
+}
+
+/*
+ * Validates the len bytes at src, at offset base of the file, and reports
+ * the errors. Unless final, a sequence truncated by the end is left for
+ * the next call. Stores the number of bytes consumed and returns false
+ * once no more input is needed, after the first error without -a.
+ */
+static bool
+check_region(file_t *f, const char *src, size_t len, unsigned long long base,
+             bool final, size_t *consumed) {
+  utf8_status_t status;
+  size_t off = 0, cur;
+
+  for (;;) {
+    status = utf8_check_status(src + off, len - off, &cur);
+    if (status == UTF8_OK || (status == UTF8_INCOMPLETE && !final)) {
+      *consumed = off + cur;
+      return true;
+    }
+
+    off += cur;
+    f->errors++;
+    if (!OptQuiet) {
+      if (position_seek(f, src, base, base + off))
+        printf("%s:%llu:%llu: offset %llu: ill-formed UTF-8 (%s)\n", f->path,
+          f->pos.line, f->pos.column + 1, base + off,
+          utf8_error_name(utf8_error_kind(src + off, len - off)));
+      else
+        printf("%s: offset %llu: ill-formed UTF-8 (%s)\n", f->path, base + off,
+          utf8_error_name(utf8_error_kind(src + off, len - off)));
+    }
+
+    if (!OptAll) {
+      *consumed = off;
+      return false;
+    }
+    off += utf8_maximal_subpart(src + off, len - off);
+  }
+}
+
+/*
+ * Validates the bytes of a regular file from start to size.
+ */
+static int
+check_mapped(file_t *f, unsigned long long start, unsigned long long size) {
+  const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  unsigned long long base;
+  size_t len, consumed;
+  char *map;
+  bool more;
+
+  while (start < size) {
+    base = start - start % page;
+    len = size - base < WINDOW ? (size_t)(size - base) : WINDOW;
+
+    map = mmap(NULL, len, PROT_READ, MAP_PRIVATE | MAP_POPULATE, f->fd, (off_t)base);
+    if (map == MAP_FAILED) {
+      fprintf(stderr, "utf8valid: %s: %s\n", f->path, strerror(errno));
+      return 2;
+    }
+    madvise(map, len, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    madvise(map, len, MADV_HUGEPAGE);
+#endif
+    if (base + len < size)
+      posix_fadvise(f->fd, (off_t)(base + len), WINDOW, POSIX_FADV_WILLNEED);
+
+    more = check_region(f, map + (start - base), len - (start - base), start,
+      base + len == size, &consumed);
+    munmap(map, len);
+    if (!more)
+      break;
+    start += consumed;
+  }
+  return f->errors ? 1 : 0;
+}
+
+static int
+check_stream(file_t *f) {
+  static char buf[CHUNK + 4];
+  unsigned long long base = 0;
+  size_t have = 0, consumed;
+  ssize_t n;
+
+  for (;;) {
+    n = read(f->fd, buf + have, CHUNK);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "utf8valid: %s: %s\n", f->path, strerror(errno));
+      return 2;
+    }
+    have += n;
+
+    if (!check_region(f, buf, have, base, n == 0, &consumed) || n == 0)
+      break;
+
+    /* The data is not kept, so lines are counted as it goes unless -q reports none */
+    if (!OptQuiet)
+      position_seek(f, buf, base, base + consumed);
+    memmove(buf, buf + consumed, have - consumed);
+    base += consumed;
+    have -= consumed;
+  }
+  return f->errors ? 1 : 0;
+}
+
+static int
+check_file(const char *path) {
+  struct stat st;
+  file_t f;
+  int status;
+
+  memset(&f, 0, sizeof(f));
+  f.pos.line = 1;
+
+  if (strcmp(path, "-") == 0) {
+    f.path = "<stdin>";
+    f.fd = STDIN_FILENO;
+  }
+  else {
+    f.path = path;
+    f.fd = open(path, O_RDONLY);
+    if (f.fd < 0) {
+      fprintf(stderr, "utf8valid: %s: %s\n", path, strerror(errno));
+      return 2;
+    }
+  }
+
+  if (fstat(f.fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    status = check_mapped(&f, 0, (unsigned long long)st.st_size);
+  else
+    status = check_stream(&f);
+
+  if (f.fd != STDIN_FILENO)
+    close(f.fd);
+  return status;
+}
+
+/*
+ *  Tree mode
+ *
+ *  Every thread of the pool has a deque of tasks. A thread pushes and pops
+ *  tasks at the bottom of its own deque, so it walks depth first, and when
+ *  it runs out steals from the top of the others, where the oldest tasks
+ *  and so the largest subtrees are.
+ *
+ *  The regular files of a directory are batched into tasks of TREE_BATCH
+ *  names that are opened relative to the directory. A file shorter than
+ *  TREE_SMALL bytes is taken in a single read into a buffer of the thread,
+ *  without a stat, a mapping or page faults. Files of TREE_HUGE bytes or
+ *  more are cut into chunks of TREE_CHUNK bytes at positions found by
+ *  utf8_resync, which any thread can validate.
+ */
+
+#define TREE_BATCH 64
+#define TREE_SMALL ((size_t)256 << 10)
+#define TREE_HUGE  ((unsigned long long)64 << 20)
+#define TREE_CHUNK ((unsigned long long)16 << 20)
+
+typedef struct {
+  DIR *dp;
+  char *path;
+  unsigned refs;              /* listing and batches not yet done */
+} tree_dir_t;
+
+typedef struct {
+  file_t f;
+  unsigned long long size;
+  unsigned long long error;   /* offset of the first ill-formed sequence or size */
+  size_t remaining;           /* chunks not yet done */
+  int status;                 /* 2 if a chunk could not be mapped */
+} tree_huge_t;
+
+enum {
+  TASK_DIR,
+  TASK_FILES,
+  TASK_CHUNK
+};
+
+typedef struct task {
+  int kind;
+  struct task *next;
+  char *path;                 /* TASK_DIR */
+  tree_dir_t *dir;            /* TASK_FILES, NULL for files given as arguments */
+  char *names;                /* TASK_FILES, count nul-terminated names */
+  unsigned count;
+  tree_huge_t *huge;          /* TASK_CHUNK */
+  unsigned long long index;
+} task_t;
+
+typedef struct {
+  pthread_mutex_t lock;
+  task_t **tasks;
+  size_t cap, head, size;     /* ring of size tasks from head, size is read unlocked */
+} deque_t;
+
+typedef struct {
+  unsigned long long files, bytes, invalid, failed;
+} totals_t;
+
+typedef struct tree tree_t;
+
+typedef struct {
+  tree_t *tree;
+  deque_t deque;
+  unsigned id;
+  unsigned seed;
+  char *buf;
+  char path[PATH_MAX];
+  totals_t totals;
+} worker_t;
+
+struct tree {
+  worker_t *workers;
+  unsigned nworkers;
+  long pending;               /* tasks pushed and not yet done */
+  long queued;                /* tasks in the deques */
+  int sleeping;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+};
+
+static void *
+xmalloc(size_t size) {
+  void *p = malloc(size);
+
+  if (!p) {
+    fprintf(stderr, "utf8valid: %s\n", strerror(ENOMEM));
+    exit(2);
+  }
+  return p;
+}
+
+static void *
+xrealloc(void *p, size_t size) {
+  p = realloc(p, size);
+  if (!p) {
+    fprintf(stderr, "utf8valid: %s\n", strerror(ENOMEM));
+    exit(2);
+  }
+  return p;
+}
+
+static task_t *
+task_new(int kind) {
+  task_t *t = (task_t *)xmalloc(sizeof(task_t));
+
+  memset(t, 0, sizeof(*t));
+  t->kind = kind;
+  return t;
+}
+
+static char *
+path_join(const char *dir, const char *name) {
+  size_t dlen = strlen(dir), nlen = strlen(name);
+  char *path = (char *)xmalloc(dlen + nlen + 2);
+
+  memcpy(path, dir, dlen);
+  if (dlen == 0 || dir[dlen - 1] != '/')
+    path[dlen++] = '/';
+  memcpy(path + dlen, name, nlen + 1);
+  return path;
+}
+
+static void
+deque_push(deque_t *d, task_t *t) {
+  task_t **tasks;
+  size_t i, cap;
+
+  pthread_mutex_lock(&d->lock);
+  if (d->size == d->cap) {
+    cap = d->cap ? d->cap * 2 : 64;
+    tasks = (task_t **)xmalloc(cap * sizeof(task_t *));
+    for (i = 0; i < d->size; i++)
+      tasks[i] = d->tasks[(d->head + i) % d->cap];
+    free(d->tasks);
+    d->tasks = tasks;
+    d->cap = cap;
+    d->head = 0;
+  }
+  d->tasks[(d->head + d->size) % d->cap] = t;
+  __atomic_store_n(&d->size, d->size + 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&d->lock);
+}
+
+static task_t *
+deque_pop(deque_t *d) {
+  task_t *t = NULL;
+
+  pthread_mutex_lock(&d->lock);
+  if (d->size > 0) {
+    __atomic_store_n(&d->size, d->size - 1, __ATOMIC_RELAXED);
+    t = d->tasks[(d->head + d->size) % d->cap];
+  }
+  pthread_mutex_unlock(&d->lock);
+  return t;
+}
+
+static task_t *
+deque_steal(deque_t *d) {
+  task_t *t = NULL;
+
+  /* Empty deques are passed over without taking their lock */
+  if (__atomic_load_n(&d->size, __ATOMIC_RELAXED) == 0)
+    return NULL;
+
+  pthread_mutex_lock(&d->lock);
+  if (d->size > 0) {
+    t = d->tasks[d->head];
+    d->head = (d->head + 1) % d->cap;
+    __atomic_store_n(&d->size, d->size - 1, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&d->lock);
+  return t;
+}
+
+static void
+tree_push(worker_t *w, task_t *t) {
+  tree_t *tree = w->tree;
+
+  __atomic_add_fetch(&tree->pending, 1, __ATOMIC_SEQ_CST);
+  deque_push(&w->deque, t);
+  __atomic_add_fetch(&tree->queued, 1, __ATOMIC_SEQ_CST);
+
+  /* A thread going to sleep counts itself before it looks at queued */
+  if (__atomic_load_n(&tree->sleeping, __ATOMIC_SEQ_CST) > 0) {
+    pthread_mutex_lock(&tree->lock);
+    pthread_cond_signal(&tree->wake);
+    pthread_mutex_unlock(&tree->lock);
+  }
+}
+
+static task_t *
+tree_next(worker_t *w) {
+  tree_t *tree = w->tree;
+  task_t *t;
+  unsigned i, victim;
+
+  t = deque_pop(&w->deque);
+  if (!t) {
+    w->seed ^= w->seed << 13;
+    w->seed ^= w->seed >> 17;
+    w->seed ^= w->seed << 5;
+    for (i = 0; i < tree->nworkers && !t; i++) {
+      victim = (w->seed + i) % tree->nworkers;
+      if (victim != w->id)
+        t = deque_steal(&tree->workers[victim].deque);
+    }
+  }
+  if (t)
+    __atomic_sub_fetch(&tree->queued, 1, __ATOMIC_SEQ_CST);
+  return t;
+}
+
+static void
+tree_count(worker_t *w, int status) {
+  if (status == 2)
+    w->totals.failed++;
+  else {
+    w->totals.files++;
+    w->totals.invalid += status;
+  }
+}
+
+static void
+tree_fail(worker_t *w, const char *path) {
+  fprintf(stderr, "utf8valid: %s: %s\n", path, strerror(errno));
+  w->totals.failed++;
+}
+
+static void
+tree_dir_release(tree_dir_t *dir) {
+  if (__atomic_sub_fetch(&dir->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    closedir(dir->dp);
+    free(dir->path);
+    free(dir);
+  }
+}
+
+static void
+tree_list(worker_t *w, task_t *t) {
+  task_t *sub, *batch, *batches = NULL;
+  tree_dir_t *dir;
+  struct dirent *e;
+  struct stat st;
+  size_t cap = 0, used = 0, n;
+  int type;
+  DIR *dp;
+
+  dp = opendir(t->path);
+  if (!dp) {
+    tree_fail(w, t->path);
+    return;
+  }
+  dir = (tree_dir_t *)xmalloc(sizeof(tree_dir_t));
+  dir->dp = dp;
+  dir->path = t->path;
+  dir->refs = 1;
+  t->path = NULL;
+
+  while ((e = readdir(dp)) != NULL) {
+    if (e->d_name[0] == '.' &&
+        (e->d_name[1] == '\0' || (e->d_name[1] == '.' && e->d_name[2] == '\0')))
+      continue;
+
+    type = e->d_type;
+    if (type == DT_UNKNOWN) {
+      if (fstatat(dirfd(dp), e->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+        continue;
+      type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+    }
+
+    if (type == DT_DIR) {
+      sub = task_new(TASK_DIR);
+      sub->path = path_join(dir->path, e->d_name);
+      tree_push(w, sub);
+    }
+    else if (type == DT_REG) {
+      if (!batches || batches->count == TREE_BATCH) {
+        batch = task_new(TASK_FILES);
+        batch->dir = dir;
+        batch->next = batches;
+        batches = batch;
+        dir->refs++;
+        cap = used = 0;
+      }
+      n = strlen(e->d_name) + 1;
+      if (used + n > cap) {
+        cap = used + n > cap * 2 ? used + n + 1024 : cap * 2;
+        batches->names = (char *)xrealloc(batches->names, cap);
+      }
+      memcpy(batches->names + used, e->d_name, n);
+      used += n;
+      batches->count++;
+    }
+  }
+
+  /* Pushed last, so the files are validated before the walk goes deeper */
+  while (batches) {
+    batch = batches;
+    batches = batch->next;
+    tree_push(w, batch);
+  }
+  tree_dir_release(dir);
+}
+
+static void
+tree_split(worker_t *w, const char *path, int fd, unsigned long long size) {
+  tree_huge_t *h = (tree_huge_t *)xmalloc(sizeof(tree_huge_t));
+  unsigned long long i;
+  task_t *t;
+
+  memset(h, 0, sizeof(*h));
+  h->f.path = strcpy((char *)xmalloc(strlen(path) + 1), path);
+  h->f.fd = fd;
+  h->f.pos.line = 1;
+  h->size = size;
+  h->error = size;
+  h->remaining = (size + TREE_CHUNK - 1) / TREE_CHUNK;
+
+  /* Pushed from the end, the owner takes the chunks in order */
+  for (i = h->remaining; i-- > 0;) {
+    t = task_new(TASK_CHUNK);
+    t->huge = h;
+    t->index = i;
+    tree_push(w, t);
+  }
+}
+
+static void
+tree_file(worker_t *w, const char *path, int fd) {
+  struct stat st;
+  size_t consumed;
+  ssize_t n;
+  file_t f;
+  int status;
+
+  memset(&f, 0, sizeof(f));
+  f.path = path;
+  f.fd = fd;
+  f.pos.line = 1;
+
+  do
+    n = read(fd, w->buf, TREE_SMALL);
+  while (n < 0 && errno == EINTR);
+
+  if (n < 0) {
+    tree_fail(w, path);
+    close(fd);
+    return;
+  }
+
+  /* A short read of a regular file ends at the end of the file */
+  if ((size_t)n < TREE_SMALL) {
+    check_region(&f, w->buf, (size_t)n, 0, true, &consumed);
+    status = f.errors ? 1 : 0;
+    w->totals.bytes += (size_t)n;
+  }
+  else if (fstat(fd, &st) != 0) {
+    tree_fail(w, path);
+    close(fd);
+    return;
+  }
+  else if ((unsigned long long)st.st_size >= TREE_HUGE) {
+    tree_split(w, path, fd, (unsigned long long)st.st_size);
+    return;
+  }
+  else {
+    status = check_mapped(&f, 0, (unsigned long long)st.st_size);
+    w->totals.bytes += (unsigned long long)st.st_size;
+  }
+
+  tree_count(w, status);
+  close(fd);
+}
+
+static void
+tree_files(worker_t *w, task_t *t) {
+  const char *name = t->names;
+  unsigned i;
+  int fd;
+
+  for (i = 0; i < t->count; i++, name += strlen(name) + 1) {
+    if (t->dir) {
+      snprintf(w->path, sizeof(w->path), "%s%s%s", t->dir->path,
+        t->dir->path[strlen(t->dir->path) - 1] == '/' ? "" : "/", name);
+      fd = openat(dirfd(t->dir->dp), name, O_RDONLY | O_NOCTTY);
+    }
+    else {
+      snprintf(w->path, sizeof(w->path), "%s", name);
+      fd = open(name, O_RDONLY | O_NOCTTY);
+    }
+
+    if (fd < 0)
+      tree_fail(w, w->path);
+    else
+      tree_file(w, w->path, fd);
+  }
+
+  if (t->dir)
+    tree_dir_release(t->dir);
+}
+
+static void
+tree_chunk(worker_t *w, task_t *t) {
+  const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  tree_huge_t *h = t->huge;
+  unsigned long long lo, hi, base, begin, end, error;
+  size_t len, cur;
+  char *map;
+  int status;
+
+  lo = t->index * TREE_CHUNK;
+  hi = lo + TREE_CHUNK < h->size ? lo + TREE_CHUNK : h->size;
+
+  /* The file is validated again from the first error, chunks after it are not needed */
+  if (lo <= __atomic_load_n(&h->error, __ATOMIC_RELAXED)) {
+    /* Three bytes before the chunk and one after it are needed to resync */
+    base = lo < 3 ? 0 : lo - 3;
+    base -= base % page;
+    len = (size_t)((hi < h->size ? hi + 1 : hi) - base);
+
+    map = mmap(NULL, len, PROT_READ, MAP_PRIVATE | MAP_POPULATE, h->f.fd, (off_t)base);
+    if (map == MAP_FAILED) {
+      fprintf(stderr, "utf8valid: %s: %s\n", h->f.path, strerror(errno));
+      __atomic_store_n(&h->status, 2, __ATOMIC_RELAXED);
+    }
+    else {
+      begin = lo == 0 ? 0 : base + utf8_resync(map, len, (size_t)(lo - base));
+      end = hi == h->size ? hi : base + utf8_resync(map, len, (size_t)(hi - base));
+
+      if (!utf8_check(map + (begin - base), (size_t)(end - begin), &cur)) {
+        error = __atomic_load_n(&h->error, __ATOMIC_RELAXED);
+        while (begin + cur < error &&
+               !__atomic_compare_exchange_n(&h->error, &error, begin + cur, true,
+                 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+          ;
+      }
+      w->totals.bytes += end - begin;
+      munmap(map, len);
+    }
+  }
+
+  if (__atomic_sub_fetch(&h->remaining, 1, __ATOMIC_ACQ_REL) != 0)
+    return;
+
+  /* The last chunk reports the file, from the first error on */
+  status = h->status;
+  if (status == 0 && h->error < h->size)
+    status = check_mapped(&h->f, h->error, h->size);
+  tree_count(w, status);
+  close(h->f.fd);
+  free((char *)h->f.path);
+  free(h);
+}
+
+static void *
+tree_worker(void *arg) {
+  worker_t *w = (worker_t *)arg;
+  tree_t *tree = w->tree;
+  task_t *t;
+
+  for (;;) {
+    t = tree_next(w);
+    if (t) {
+      switch (t->kind) {
+        case TASK_DIR:
+          tree_list(w, t);
+          break;
+        case TASK_FILES:
+          tree_files(w, t);
+          break;
+        case TASK_CHUNK:
+          tree_chunk(w, t);
+          break;
+      }
+      free(t->path);
+      free(t->names);
+      free(t);
+
+      if (__atomic_sub_fetch(&tree->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+        pthread_mutex_lock(&tree->lock);
+        pthread_cond_broadcast(&tree->wake);
+        pthread_mutex_unlock(&tree->lock);
+      }
+      continue;
+    }
+
+    pthread_mutex_lock(&tree->lock);
+    if (__atomic_load_n(&tree->pending, __ATOMIC_SEQ_CST) == 0) {
+      pthread_mutex_unlock(&tree->lock);
+      break;
+    }
+    __atomic_add_fetch(&tree->sleeping, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&tree->queued, __ATOMIC_SEQ_CST) == 0 &&
+           __atomic_load_n(&tree->pending, __ATOMIC_SEQ_CST) > 0)
+      pthread_cond_wait(&tree->wake, &tree->lock);
+    __atomic_sub_fetch(&tree->sleeping, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&tree->lock);
+  }
+  return NULL;
+}
+
+static double
+now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Validates the files and directory trees on a pool of nthreads threads,
+ * including the calling thread, and prints a summary.
+ */
+static int
+check_tree(char **paths, int npaths, unsigned nthreads) {
+  tree_t tree;
+  worker_t *w;
+  totals_t total;
+  pthread_t *threads;
+  struct rlimit rl;
+  struct stat st;
+  unsigned i, n;
+  double start, elapsed;
+  task_t *t;
+  int p;
+
+  if (nthreads == 0) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = ncpu > 0 ? (unsigned)ncpu : 1;
+  }
+
+  /* Directories and split files are held open while their tasks are queued */
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+
+  memset(&tree, 0, sizeof(tree));
+  pthread_mutex_init(&tree.lock, NULL);
+  pthread_cond_init(&tree.wake, NULL);
+  tree.nworkers = nthreads;
+  tree.workers = (worker_t *)xmalloc(sizeof(worker_t) * nthreads);
+  memset(tree.workers, 0, sizeof(worker_t) * nthreads);
+  for (i = 0; i < nthreads; i++) {
+    w = &tree.workers[i];
+    w->tree = &tree;
+    w->id = i;
+    w->seed = 2654435761u * (i + 1);
+    w->buf = (char *)xmalloc(TREE_SMALL);
+    pthread_mutex_init(&w->deque.lock, NULL);
+  }
+
+  start = now();
+
+  /* Standard input and other files than regular files are read here */
+  w = &tree.workers[0];
+  for (p = 0; p < npaths; p++) {
+    if (strcmp(paths[p], "-") == 0)
+      tree_count(w, check_file(paths[p]));
+    else if (stat(paths[p], &st) != 0)
+      tree_fail(w, paths[p]);
+    else if (S_ISDIR(st.st_mode)) {
+      t = task_new(TASK_DIR);
+      t->path = strcpy((char *)xmalloc(strlen(paths[p]) + 1), paths[p]);
+      tree_push(w, t);
+    }
+    else if (S_ISREG(st.st_mode)) {
+      t = task_new(TASK_FILES);
+      t->names = strcpy((char *)xmalloc(strlen(paths[p]) + 1), paths[p]);
+      t->count = 1;
+      tree_push(w, t);
+    }
+    else
+      tree_count(w, check_file(paths[p]));
+  }
+
+  /* Resolve the kernel before the threads race to do it */
+  utf8_kernel();
+
+  threads = (pthread_t *)malloc(sizeof(pthread_t) * (nthreads - 1));
+  for (n = 0; threads && n < nthreads - 1; n++) {
+    if (pthread_create(&threads[n], NULL, tree_worker, &tree.workers[n + 1]) != 0)
+      break;
+  }
+
+  tree_worker(&tree.workers[0]);
+
+  for (i = 0; i < n; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+  elapsed = now() - start;
+
+  memset(&total, 0, sizeof(total));
+  for (i = 0; i < nthreads; i++) {
+    w = &tree.workers[i];
+    total.files += w->totals.files;
+    total.bytes += w->totals.bytes;
+    total.invalid += w->totals.invalid;
+    total.failed += w->totals.failed;
+    free(w->buf);
+    free(w->deque.tasks);
+    pthread_mutex_destroy(&w->deque.lock);
+  }
+  free(tree.workers);
+  pthread_cond_destroy(&tree.wake);
+  pthread_mutex_destroy(&tree.lock);
+
+  if (!OptQuiet)
+    fprintf(stderr,
+      "utf8valid: %llu files, %llu ill-formed, %llu unreadable, %.3f GB in %.3f s, "
+      "%.2f GB/s, %.0f files/s, %u threads\n",
+      total.files, total.invalid, total.failed, total.bytes * 1e-9, elapsed,
+      elapsed > 0 ? total.bytes / elapsed * 1e-9 : 0.0,
+      elapsed > 0 ? total.files / elapsed : 0.0, nthreads);
+
+  return total.failed ? 2 : total.invalid ? 1 : 0;
+}
+
+static void
+usage(void) {
+  fprintf(stderr,
+    "usage: utf8valid [-a] [-q] [-r] [-j threads] [file ...]\n"
+    "  -a  report every ill-formed sequence, not only the first\n"
+    "  -q  report nothing, only set the exit status\n"
+    "  -r  validate directory trees on a pool of threads and print a summary\n"
+    "  -j  number of threads for -r, one per online CPU by default\n");
+}
+
+int
+main(int argc, char **argv) {
+  int opt, status = 0, s, i;
+
+  while ((opt = getopt(argc, argv, "aqrj:h")) != -1) {
+    switch (opt) {
+      case 'a':
+        OptAll = true;
+        break;
+      case 'q':
+        OptQuiet = true;
+        break;
+      case 'r':
+        OptRecurse = true;
+        break;
+      case 'j':
+        OptThreads = (unsigned)strtoul(optarg, NULL, 10);
+        break;
+      default:
+        usage();
+        return 2;
+    }
+  }
+
+  if (optind == argc)
+    return check_file("-");
+
+  if (OptRecurse)
+    return check_tree(argv + optind, argc - optind, OptThreads);
+
+  for (i = optind; i < argc; i++) {
+    s = check_file(argv[i]);
+    if (s > status)
+      status = s;
+  }
+  return status;
+}